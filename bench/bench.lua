@@ -0,0 +1,185 @@
+--[[
+Benchmarks of the completion and history hot paths of the readline module
+
+Usage: lua bench/bench.lua [pattern]
+The module is loaded with require, so readline.so has to be on package.cpath (LUA_CPATH).
+Only the benchmarks with names matching the Lua pattern are run if one is given.
+
+Everything runs non-interactively: the keystrokes are scripted into a temporary file
+read by a readline.session, and the output goes to /dev/null. Each result is printed
+as a line of JSON, so the runs on different Lua versions and builds can be compared:
+{"bench": ..., "size": ..., "iterations": ..., "seconds": ..., "us_per_op": ..., "lua": ...}
+The times are CPU times measured with os.clock.
+]]
+
+local readline = require "readline"
+
+local filter = arg and arg[1]
+local lua = jit and jit.version or _VERSION
+local null = assert(io.open("/dev/null", "w"))
+
+local function report(bench, size, iterations, seconds)
+	io.write(string.format('{"bench": "%s", "size": %d, "iterations": %d, "seconds": %.6f, "us_per_op": %.3f, "lua": "%s"}\n',
+		bench, size, iterations, seconds, seconds * 1e6 / iterations, lua))
+	io.flush()
+end
+
+local function selected(bench)
+	return not filter or bench:find(filter) ~= nil
+end
+
+-- Runs fn(iterations) and reports the time it took
+local function run(bench, size, iterations, fn)
+	if not selected(bench) then
+		return
+	end
+	collectgarbage()
+	collectgarbage()
+	local start = os.clock()
+	fn(iterations)
+	report(bench, size, iterations, os.clock() - start)
+end
+
+-- Returns a session reading the given keystrokes over and over, lines lines of them in total
+local function scripted(keys, lines)
+	local input = assert(io.tmpfile())
+	input:write(string.rep(keys, lines))
+	input:seek("set")
+	return readline.session{input = input, output = null, name = "bench"}, input
+end
+
+-- Reads the lines a scripted session has, with libreadline doing the editing and completion
+local function readlines(session, iterations, gen, opts)
+	opts = opts or {}
+	if opts.fast == nil then
+		opts.fast = false
+	end
+	for _ = 1, iterations do
+		session:readline("", gen, opts)
+	end
+end
+
+local function candidates(size)
+	local tbl = {}
+	for i = 1, size do
+		tbl[i] = string.format("w%07d", (i * 7919) % size)
+	end
+	return tbl
+end
+
+-- The number of completions to time for a candidate set, fewer for the larger ones
+local function rounds(size)
+	return math.max(5, math.floor(2e6 / size))
+end
+
+-- Completion latency: one TAB on a prefix matching a handful of candidates of every set
+for _, size in ipairs{1000, 100000, 1000000} do
+	local tbl = candidates(size)
+	local idx = readline.index(tbl)
+	local keys = "w00001\t\n"
+	local n = rounds(size)
+	local function complete(bench, gen, opts)
+		if not selected(bench) then
+			return
+		end
+		local session, input = scripted(keys, n)
+		run(bench, size, n, function(iterations)
+			readlines(session, iterations, gen, opts)
+		end)
+		session:close()
+		input:close()
+	end
+	complete("complete_table", tbl)
+	complete("complete_table_batch", tbl, {batch = true})
+	complete("complete_index", idx)
+	complete("complete_index_batch", idx, {batch = true})
+	complete("complete_function", function(text)
+		local i, len = 0, #text
+		return function()
+			while true do
+				i = i + 1
+				local s = tbl[i]
+				if s == nil or s:sub(1, len) == text then
+					return s
+				end
+			end
+		end
+	end)
+	complete("complete_function_batch", function(text)
+		local res, len = {}, #text
+		for i = 1, #tbl do
+			if tbl[i]:sub(1, len) == text then
+				res[#res + 1] = tbl[i]
+			end
+		end
+		return res
+	end, {batch = true})
+	complete("complete_function_index", function(text)
+		return idx
+	end, {batch = true})
+	complete("complete_fuzzy_index", idx, {fuzzy = true})
+	tbl, idx = nil, nil
+end
+
+-- Per-call overhead of readline with an empty line, through libreadline and the fast path
+for _, fast in ipairs{false, true} do
+	local bench = fast and "readline_fast" or "readline_call"
+	if selected(bench) then
+		local n = fast and 200000 or 20000
+		local session, input = scripted("\n", n)
+		run(bench, 0, n, function(iterations)
+			readlines(session, iterations, nil, {fast = fast})
+		end)
+		session:close()
+		input:close()
+	end
+end
+
+-- Pasting a block of lines in the bracketed paste mode, as libreadline takes it and in bulk
+for _, paste in ipairs{false, "accept"} do
+	local bench = paste and "paste_bulk" or "paste_readline"
+	local size = 5000
+	if selected(bench) then
+		local block = {}
+		for i = 1, size do
+			block[i] = string.format("local x%d = %d", i, i)
+		end
+		local n = 20
+		local session, input = scripted("\027[200~" .. table.concat(block, "\r") .. "\027[201~\n", n)
+		run(bench, size, n, function(iterations)
+			readlines(session, iterations, nil, {paste = paste})
+		end)
+		session:close()
+		input:close()
+	end
+end
+
+-- History throughput, on a session not to touch the history of the process
+for _, size in ipairs{1000, 100000} do
+	local session = readline.session{input = io.stdin, output = null, name = "bench"}
+	run("addhistory", size, size, function(iterations)
+		for i = 1, iterations do
+			session:addhistory("history line " .. i)
+		end
+	end)
+	run("addhistory_erasedups", size, size, function(iterations)
+		readline.historydups("erasedups")
+		for i = 1, iterations do
+			session:addhistory("history line " .. (i % 100))
+		end
+		readline.historydups("keep")
+	end)
+	local path = os.tmpname()
+	session:savehistory(path)
+	session:close()
+	run("loadhistory", size, 10, function(iterations)
+		for _ = 1, iterations do
+			local s = readline.session{input = io.stdin, output = null, name = "bench"}
+			assert(s:loadhistory(path))
+			s:close()
+		end
+	end)
+	os.remove(path)
+end
+
+null:close()
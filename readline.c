@@ -2,273 +2,6378 @@
  * See the LICENSE file for the copyright notice
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <signal.h>
-#include <setjmp.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <termios.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <wchar.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define LUA_LIB
 #include "lauxlib.h"
 
-static int lua_readline(lua_State*);
-static void lua_initgenerator(lua_State*, const char*);
+struct _context_t;
+struct _session_t;
+struct _prefetch_t;
 static char* gen_function(const char*, int);
+static char** batch_function(const char*, int, int);
+static void callback_linehandler(char*);
+static void callback_install(lua_State*, struct _context_t*, const char*, int, int);
+static void history_push(struct _context_t*, const char*);
+static void prefetch_reset(struct _prefetch_t*);
+static void ctx_closesession(struct _context_t*);
 
-static void *REGISTRY_KEY_GENERATOR = (void*) lua_readline;
-static void *REGISTRY_KEY_ITERATOR = (void*) lua_initgenerator;
-static lua_State *globalL;
-static sigjmp_buf globalEnv;
+/* Whether a SIGINT should cancel the readline() call in progress, and the thread running it */
+static volatile sig_atomic_t globalArmed;
+static pthread_t globalReadingThread;
+/* Set by readline_sigint when the readline() call in progress is to be cancelled */
+static volatile sig_atomic_t globalInterrupted;
+/* Whether readline_sigint is installed and the action it has replaced */
+static volatile sig_atomic_t globalSigintInstalled;
+static struct sigaction globalOldSigint;
+/* Incremented every time the completion is set up, to detect changes */
+static unsigned long globalSerial;
+/* Serialises the use of libreadline between the Lua states, recursive for nested calls */
+static pthread_mutex_t globalLock;
+static pthread_once_t globalLockOnce = PTHREAD_ONCE_INIT;
+/* The context whose history list is current, and which libreadline callbacks are called for */
+static struct _context_t *globalCtx;
+/* The context which has installed the libreadline callback handler */
+static struct _context_t *globalCallbackCtx;
+/* The history list libreadline is using */
+static struct _hist_t *globalHist;
+/* The session whose streams libreadline is using, NULL for the default ones */
+static struct _session_t *globalSession;
+/* The default streams, name and terminal functions of libreadline while a session is using it */
+static FILE *globalDefaultIn;
+static FILE *globalDefaultOut;
+static const char *globalDefaultName;
+static rl_vintfunc_t *globalDefaultPrep;
+static rl_voidfunc_t *globalDefaultDeprep;
+/* The number of sessions having a callback handler installed */
+static int globalInstalledSessions;
+/* The input paste_read has read past the end of a paste and the stream it's from, handed out by readline_getc
+ * before the stream is read again */
+static FILE *globalPendingStream;
+static char *globalPendingInput;
+static size_t globalPendingLen;
+static size_t globalPendingPos;
+/* Set while paste_read takes the keys libreadline has read ahead, readline_getc then reports there are no more */
+static int globalDraining;
+
+#define INDEX_METATABLE "readline.index"
+#define CONTEXT_METATABLE "readline.context"
+#define SESSION_METATABLE "readline.session"
+/* The number of matches collected from a table or an index between the checks of the completion deadline */
+#define DEADLINE_STRIDE 64
+/* The garbage left in the blob of a dictionary by the removed strings that makes it worth compacting */
+#define INDEX_COMPACT 4096
+/* The number of directory listings kept by readline.files */
+#define DIRCACHE_SIZE 32
+/* The number of entries of a history log materialised at once by default */
+#define HISTLOG_CHUNK 256
+/* The number of distinct escape sequences readline.highlight can use in a line */
+#define HIGHLIGHT_STYLES 255
+/* The sequences a terminal puts the pasted text between in the bracketed paste mode */
+#define PASTE_START "\033[200~"
+#define PASTE_END "\033[201~"
+/* The number of bytes paste_read reads at once */
+#define PASTE_CHUNK 65536
+
+#if LUA_VERSION_NUM < 502
+#define lua_rawlen lua_objlen
+#endif
+#ifndef LUA_FILEHANDLE
+#define LUA_FILEHANDLE "FILE*"
+#endif
+
+/**
+ * A sorted prefix index of completion candidates built by readline.index() or readline.dict()
+ * All the strings are stored NUL-terminated one after another in a single blob,
+ * offs holds the offsets of the strings in the blob in lexicographic order
+ */
+typedef struct _index_t {
+	char *blob;
+	uint32_t *offs;
+	size_t count;
+	/* The character masks of the strings for the fuzzy matcher, computed on the first fuzzy completion */
+	uint64_t *masks;
+	/* The bytes of the blob in use and allocated, the offsets allocated, and the bytes in use
+	 * taken by the strings removed, which are reclaimed by index_compact */
+	size_t used;
+	size_t blobcap;
+	size_t offcap;
+	size_t garbage;
+	/* The mapping of the file compiled by readline.compiledict the blob and the offsets point into,
+	 * NULL if they are allocated */
+	void *map;
+	size_t mapsize;
+} index_t;
+
+/* The magic number of the files written by readline.compiledict, the last characters being the version */
+#define DICT_MAGIC "LRLDCT01"
+/* Written in the native byte order, telling the files compiled on a host of another byte order */
+#define DICT_ORDER 0x01020304
+
+/**
+ * The header of a compiled dictionary file. It's followed by count 32-bit offsets and then by the blob
+ * of bloblen bytes holding the strings NUL-terminated in the sorted order
+ */
+typedef struct _dictheader_t {
+	char magic[8];
+	uint32_t order;
+	uint32_t count;
+	uint32_t bloblen;
+	uint32_t reserved;
+} dictheader_t;
+
+/**
+ * A growable vector of completion matches in the format expected by libreadline:
+ * the first slot is reserved for the common prefix of the matches, the vector is NULL-terminated
+ */
+typedef struct _matches_t {
+	char **v;
+	size_t n;
+	size_t cap;
+	/* The number of candidates checked by matches_addtable */
+	size_t scanned;
+	/* The number of matches to stop collecting at, 0 if unlimited, and the time to stop at
+	 * in CLOCK_MONOTONIC milliseconds, 0 if none. truncated tells which one has been hit, if any */
+	size_t limit;
+	uint64_t deadline;
+	int truncated;
+} matches_t;
+
+/* Why a completion has been cut short, for readline.truncated */
+enum { TRUNCATED_NONE, TRUNCATED_LIMIT, TRUNCATED_TIMEOUT };
+
+/**
+ * The completion prefix cache
+ * Holds the matches the generator produced for a prefix, so that refining the prefix
+ * is served by filtering them in C instead of calling the generator again.
+ * The generator the matches came from is referenced by the cachesource field of the context
+ */
+typedef struct _cache_t {
+	char *prefix;
+	/* The part of the line before the word, which the generator may have taken into account */
+	char *before;
+	index_t idx;
+	/* Whether the generator has asked libreadline for file name completion, as readline.files does */
+	int filenames;
+} cache_t;
+
+/**
+ * The completion prefetch: a worker thread looking the word being edited up in an index,
+ * so that the matches are mostly ready when completion is requested
+ * The fields below lock are shared with the worker and protected by it
+ */
+typedef struct _prefetch_t {
+	pthread_t thread;
+	int started;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* The index to look the prefixes up in, referenced by the index field of the context */
+	const index_t *idx;
+	/* The prefix requested last and its generation, bumped to cancel the lookup in progress */
+	char *want;
+	unsigned long gen;
+	/* The generation the worker has finished last, and whether it's in the middle of a lookup */
+	unsigned long done;
+	int busy;
+	/* The matches of the prefix have, in the index order */
+	char *have;
+	matches_t result;
+	/* The number of matches a lookup stops at, 0 if unlimited, the limit of the completion */
+	size_t limit;
+	int quit;
+} prefetch_t;
+
+/**
+ * A directory listing cached by readline.files
+ * The listing is trusted while the directory has the same modification time,
+ * or for the TTL set with readline.filecache after it has been checked
+ */
+typedef struct _dircache_t {
+	/* The path of the directory, NULL if the slot is free */
+	char *path;
+	struct timespec mtime;
+	/* When the listing was read or checked last, in CLOCK_MONOTONIC milliseconds */
+	uint64_t checked;
+	/* The registry reference to the index of the names in the directory */
+	int listing;
+} dircache_t;
+
+/**
+ * A copy of a history entry kept by the history mirror
+ */
+typedef struct _hentry_t {
+	/* Increasing in the history order */
+	unsigned long seq;
+	uint32_t hash;
+	size_t len;
+	/* The history list entry and its line the copy has been made of, to tell if libreadline has replaced them */
+	const HIST_ENTRY *entry;
+	const char *line;
+	char str[1];
+} hentry_t;
+
+/**
+ * The history mirror: copies of the history list entries in the same order, plus a hash set of them,
+ * so that duplicates can be found without scanning the history list.
+ * It's only built when a feature needs it, and rebuilt if the history list has been changed behind its back
+ */
+typedef struct _hmirror_t {
+	/* The entries in the history list order */
+	hentry_t **v;
+	size_t n;
+	size_t cap;
+	/* Open addressing hash set of the entries, cap is a power of two */
+	hentry_t **slots;
+	size_t slotcap;
+	unsigned long nextseq;
+	/* The total size of the lines including the terminating NULs */
+	size_t bytes;
+	/* The search index: the entries ordered by the line and then by seq, built on the first search.
+	 * The entries from indexedseq on are appended to it lazily on the next search */
+	hentry_t **sorted;
+	size_t nsorted;
+	unsigned long indexedseq;
+	int indexed;
+	int valid;
+	/* Set when libreadline may have edited the entries in place, hmirror_sync then checks them */
+	int suspect;
+} hmirror_t;
+
+/**
+ * An on-disk history log attached by readline.historylog: a history file that is only appended to,
+ * memory-mapped as it was when attached. The entries are materialised into the history list lazily,
+ * newest first, as readline navigates past the oldest entry it has or a search needs them
+ */
+typedef struct _histlog_t {
+	int attached;
+	int fd;
+	/* The mapped contents of the file, NULL if it was empty */
+	char *map;
+	size_t size;
+	/* The entries before this offset in the map haven't been materialised */
+	size_t cursor;
+	/* The number of entries to materialise at once */
+	size_t chunk;
+	/* Whether the lines added to the history list are appended to the file */
+	int append;
+} histlog_t;
+
+/**
+ * A history list and the bookkeeping of the library for it
+ * The list is handed to libreadline while it's the current one (globalHist), and saved here otherwise
+ */
+typedef struct _hist_t {
+	HISTORY_STATE state;
+	int maxentries;
+	/* Whether state holds a saved list */
+	int saved;
+	/* The number of entries added since the history was last loaded or saved */
+	unsigned long added;
+	/* The total size of the lines including the terminating NULs, kept for readline.historylimit
+	 * without the mirror. It's the total of the first counted entries, recounted when they're not the list */
+	size_t bytes;
+	int counted;
+	hmirror_t mirror;
+	histlog_t log;
+} hist_t;
+
+/* Duplicate handling modes for readline.addhistory */
+enum { DUPS_KEEP, DUPS_IGNORE, DUPS_IGNOREALL, DUPS_ERASE };
+
+/* How the paste option has the pasted text taken: inserted into the line or accepted with it */
+enum { PASTE_OFF, PASTE_INSERT, PASTE_ACCEPT };
+
+/**
+ * The state of readline.highlight for the line being edited: the line as it's been coloured, the style of every byte
+ * and the display column every byte starts at, so that only the part of the line that has changed is coloured again
+ */
+typedef struct _highlight_t {
+	/* The registry reference to the highlighting function */
+	int fn;
+	char *line;
+	size_t len;
+	size_t cap;
+	/* The style of every byte, an index into styles or 0 for none, and the columns, cols[len] being the width */
+	unsigned char *style;
+	uint32_t *cols;
+	/* The first byte that can't be displayed as is, a control character or an invalid sequence, len if none */
+	size_t bad;
+	/* The escape sequences of the styles used in the line, styles[0] being unused */
+	char *styles[HIGHLIGHT_STYLES + 1];
+	int nstyles;
+	/* Whether the screen shows the line in the styles */
+	int valid;
+} highlight_t;
+
+/**
+ * The Lua functions readline.bind has bound to the keys ending key sequences in a keymap,
+ * as registry references indexed by the key, so that a keystroke is dispatched without a lookup by name
+ */
+typedef struct _binding_t {
+	Keymap map;
+	int refs[KEYMAP_SIZE];
+} binding_t;
+
+/**
+ * The counters of readline.stats, only updated while enabled, the times are in nanoseconds
+ */
+typedef struct _stats_t {
+	int enabled;
+	/* Completions requested by libreadline */
+	unsigned long completions;
+	/* Calls of generator functions and iterators, and the time spent in them */
+	unsigned long inits;
+	uint64_t initns;
+	unsigned long steps;
+	uint64_t stepns;
+	/* Candidates checked against the prefix in a table and the ones matching it */
+	unsigned long scanned;
+	unsigned long matched;
+	/* The memory allocated for the matches handed over to libreadline */
+	uint64_t matchbytes;
+	/* Calls of readline() and the time spent in them, and the ones cancelled by SIGINT */
+	unsigned long reads;
+	uint64_t readns;
+	unsigned long cancels;
+	/* When the readline() call in progress has started */
+	uint64_t readstart;
+} stats_t;
+
+/**
+ * The state of the library for a Lua state
+ * Every Lua state opening the library gets its own context, passed to the library functions as an upvalue.
+ * libreadline and the history list are process globals, so they are serialised with globalLock,
+ * and the history list of the context using them is switched in by ctx_enter
+ */
+typedef struct _context_t {
+	/* The Lua thread to call the generators and handlers on */
+	lua_State *L;
+	/* Nesting depth of ctx_enter calls */
+	int depth;
+	/* Registry references to the generator, the iterator it has returned, the generator as given
+	 * to the readline function, the generator the cached matches came from, the callback handler,
+	 * and an error raised by any of them while libreadline was running */
+	int generator;
+	int iterator;
+	int source;
+	int cachesource;
+	int handler;
+	int error;
+	/* Whether an error is referenced by the error field */
+	int failed;
+	/* The number of the best fuzzy matches to collect, 0 unless fuzzy matching is enabled */
+	size_t fuzzy;
+	/* The number of matches to stop the completion at, 0 if unlimited, or whether it follows rl_completion_query_items.
+	 * Whether the last completion has been stopped at it, and the number of matches handed out in the per-item mode */
+	size_t limit;
+	int limitquery;
+	int truncated;
+	size_t handed;
+	/* The time budget of a completion in milliseconds, 0 if none, and the deadline of the one in progress
+	 * in the per-item mode */
+	uint64_t timeout;
+	uint64_t deadline;
+	/* The bounds of the word being completed in rl_line_buffer, as libreadline has passed them
+	 * to rl_attempted_completion_function */
+	int wordstart;
+	int wordend;
+	/* The directory listings of readline.files, and the time they are trusted for in milliseconds, 0 to always check */
+	dircache_t dircache[DIRCACHE_SIZE];
+	uint64_t dirttl;
+	stats_t stats;
+	highlight_t highlight;
+	/* The keymaps with the keys bound to Lua functions by readline.bind */
+	binding_t *bindings;
+	size_t nbindings;
+	/* The registry reference to the function of the display option, whether the matches are paged instead,
+	 * and the index a paged completion cut short at a page goes on from: the prefix, the position
+	 * of the next match, the end of the matches and the length of their common prefix */
+	int display;
+	int paging;
+	int pageindex;
+	char *pageprefix;
+	size_t pagenext;
+	size_t pageend;
+	size_t pagelcd;
+	/* The completion prefix cache and whether the readline function was asked to use it */
+	cache_t cache;
+	int caching;
+	/* Whether the completion is prefetched, and the registry reference to the index it's prefetched from */
+	int prefetching;
+	int prefetchindex;
+	prefetch_t prefetch;
+	/* Matches being handed out one by one to libreadline when caching or prefetching in the per-item mode */
+	matches_t pending;
+	size_t pendingpos;
+	/* The input stream checked by usefastpath last time and whether it is a terminal */
+	FILE *ttystream;
+	int ttyresult;
+	/* The line buffer reused by readline_fast */
+	char *linebuf;
+	size_t linecap;
+	/* The buffer readline.readchunk gathers the lines of a chunk in */
+	char *chunkbuf;
+	size_t chunkcap;
+	/* Whether the last line read through libreadline has been cancelled by SIGINT */
+	int cancelled;
+	/* How readline.readline takes pasted text: 0 as libreadline does, PASTE_INSERT or PASTE_ACCEPT.
+	 * The bindings of PASTE_START in the emacs and vi insertion keymaps replaced for the call,
+	 * whether they have been, and whether the bracketed paste mode was on before it */
+	int paste;
+	rl_command_func_t *pastesaved[2];
+	int pastebound[2];
+	int pastewason;
+	/* Whether a callback handler is installed by this context */
+	int installed;
+	/* Whether the callback handler is installed by readline.co_readline, and the line it has got */
+	int cowaiting;
+	int codone;
+	char *coline;
+	/* The history list of the context, and the list ctx_enter has made current for the call */
+	hist_t ownhist;
+	hist_t *hist;
+	/* The session the library function being called works with, NULL for the default streams */
+	struct _session_t *session;
+	int dupsmode;
+	/* The limit of the total size of the history lines set by readline.historylimit, 0 if unlimited */
+	size_t historymaxbytes;
+	/* A reference to the session collected while a call was using it, closed by ctx_leave once the call is over */
+	int closing;
+} context_t;
+
+/**
+ * A readline session created by readline.session: a pair of streams with a history list
+ * and a callback handler of their own, so that several terminals can be served by one process
+ */
+typedef struct _session_t {
+	FILE *in;
+	FILE *out;
+	/* Whether the streams have been opened by the session, and references to the Lua files they belong to otherwise */
+	int ownin;
+	int ownout;
+	int inref;
+	int outref;
+	/* The value of rl_readline_name for the session */
+	char *name;
+	hist_t hist;
+	/* The line state of libreadline saved while another session is using it */
+	struct readline_state state;
+	int hasstate;
+	/* The terminal settings replaced by session_prepterm */
+	struct termios tio;
+	int prepped;
+	/* Whether a callback handler is installed, and references to it and the completion set up with it */
+	int installed;
+	int handler;
+	int generator;
+	int opts;
+	/* The value of globalSerial when the completion was set up for the handler */
+	unsigned long serial;
+	int closed;
+} session_t;
+
+/**
+ * Returns the context of the library, which is the first upvalue of the library functions
+ */
+static context_t* getcontext(lua_State *L)
+{
+	return (context_t*) lua_touserdata(L, lua_upvalueindex(1));
+}
+
+/**
+ * Pops the value on top of the stack and stores it to a registry reference, releasing the old value
+ */
+static void setref(lua_State *L, int *ref)
+{
+	luaL_unref(L, LUA_REGISTRYINDEX, *ref);
+	*ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/**
+ * Pushes the value stored to a registry reference, nil if there is none
+ */
+static void getref(lua_State *L, int ref)
+{
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+}
+
+/**
+ * Initializes globalLock as a recursive mutex
+ */
+static void lock_init(void)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&globalLock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+/**
+ * Makes a history list the current one, saving the previous current list
+ * The first list made current adopts the one libreadline has, the others start empty
+ */
+static void hist_switch(hist_t *h)
+{
+	if (h == globalHist)
+		return;
+	if (globalHist) {
+		HISTORY_STATE *hs = history_get_history_state();
+		globalHist->state = *hs;
+		globalHist->maxentries = history_max_entries;
+		globalHist->saved = 1;
+		free(hs);
+	}
+	if (h->saved || globalHist) {
+		history_set_history_state(&h->state);
+		/* history_set_history_state never clears the stifled flag */
+		if (h->state.flags & HS_STIFLED)
+			stifle_history(h->maxentries);
+		else
+			unstifle_history();
+		h->saved = 0;
+	}
+	globalHist = h;
+}
+
+/**
+ * Frees a history list, unless it's current and keep is nonzero, in which case it's left to libreadline
+ * The mirror of the list is freed by the caller
+ */
+static void hist_free(hist_t *h, int keep)
+{
+	int i;
+	if (h == globalHist) {
+		if (!keep)
+			clear_history();
+		globalHist = NULL;
+	} else if (h->saved) {
+		for (i = 0; i < h->state.length; i++)
+			free_history_entry(h->state.entries[i]);
+		free(h->state.entries);
+		h->saved = 0;
+	}
+}
+
+/**
+ * Detaches the history log of a history list, unmapping and closing the file
+ */
+static void histlog_close(histlog_t *log)
+{
+	if (!log->attached)
+		return;
+	if (log->map)
+		munmap(log->map, log->size);
+	close(log->fd);
+	memset(log, 0, sizeof(histlog_t));
+}
+
+/**
+ * Attaches a history log to a history list, replacing the one it has
+ * Returns 0 or the error number
+ */
+static int histlog_open(histlog_t *log, const char *path, size_t chunk, int append)
+{
+	int fd = open(path, append ? O_RDWR | O_APPEND | O_CREAT : O_RDONLY, 0600), err = 0;
+	if (fd < 0)
+		return errno;
+	struct stat st;
+	void *map = NULL;
+	if (fstat(fd, &st) < 0)
+		err = errno;
+	else if (st.st_size > 0 && (map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		err = errno;
+		map = NULL;
+	}
+	if (err) {
+		close(fd);
+		return err;
+	}
+	histlog_close(log);
+	log->attached = 1;
+	log->fd = fd;
+	log->map = (char*) map;
+	log->size = log->cursor = map ? (size_t) st.st_size : 0;
+	log->chunk = chunk;
+	log->append = append;
+	return 0;
+}
+
+/**
+ * Checks if a line of a history file is a timestamp, the way read_history does
+ */
+static int histlog_istimestamp(const char *s, size_t len)
+{
+	return len > 1 && history_comment_char && s[0] == history_comment_char && s[1] >= '0' && s[1] <= '9';
+}
+
+/**
+ * Finds the entry of a history log before the offset pos, skipping the empty lines and the timestamps
+ * Returns 1 and sets pos and len to the offset and the length of its line, and ts and tslen to those of
+ * the timestamp line preceding it, tslen being 0 if there is none. Returns 0 if there are no more entries
+ */
+static int histlog_prev(const histlog_t *log, size_t *pos, size_t *len, size_t *ts, size_t *tslen)
+{
+	size_t end = *pos;
+	while (end > 0) {
+		/* The last line of the file may lack the newline */
+		size_t stop = log->map[end - 1] == '\n' ? end - 1 : end;
+		const char *nl = (const char*) memrchr(log->map, '\n', stop);
+		size_t start = nl ? (size_t) (nl - log->map) + 1 : 0;
+		end = start;
+		if (stop == start || histlog_istimestamp(log->map + start, stop - start))
+			continue;
+		*pos = start;
+		*len = stop - start;
+		*ts = *tslen = 0;
+		if (start > 0) {
+			nl = (const char*) memrchr(log->map, '\n', start - 1);
+			size_t prev = nl ? (size_t) (nl - log->map) + 1 : 0;
+			if (histlog_istimestamp(log->map + prev, start - 1 - prev)) {
+				*ts = prev;
+				*tslen = start - 1 - prev;
+			}
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Materialises up to n more entries of the history log of the current history list, the ones older than
+ * those the list has, keeping the position in the list. A stifled list is only filled up to its limit
+ * Returns 0 if out of memory
+ */
+static int histlog_load(hist_t *h, size_t n)
+{
+	histlog_t *log = &h->log;
+	if (!log->attached || !log->cursor || !n)
+		return 1;
+	if (history_is_stifled()) {
+		if (history_length >= history_max_entries)
+			return 1;
+		if (n > (size_t) (history_max_entries - history_length))
+			n = (size_t) (history_max_entries - history_length);
+	}
+	HIST_ENTRY **older = (HIST_ENTRY**) malloc(n * sizeof(HIST_ENTRY*));
+	if (!older)
+		return 0;
+	size_t k = 0, i, pos = log->cursor, len, ts, tslen;
+	int ok = 1;
+	/* The entries are collected newest first */
+	while (k < n && histlog_prev(log, &pos, &len, &ts, &tslen)) {
+		HIST_ENTRY *e = (HIST_ENTRY*) malloc(sizeof(HIST_ENTRY));
+		char *line = (char*) malloc(len + 1), *stamp = (char*) malloc(tslen + 1);
+		if (!e || !line || !stamp) {
+			free(e);
+			free(line);
+			free(stamp);
+			ok = 0;
+			break;
+		}
+		memcpy(line, log->map + pos, len);
+		line[len] = '\0';
+		memcpy(stamp, log->map + ts, tslen);
+		stamp[tslen] = '\0';
+		e->line = line;
+		e->timestamp = stamp;
+		e->data = NULL;
+		older[k++] = e;
+	}
+	HISTORY_STATE *hs = NULL;
+	HIST_ENTRY **v = NULL;
+	if (k) {
+		hs = history_get_history_state();
+		v = hs ? (HIST_ENTRY**) malloc((hs->length + k + 1) * sizeof(HIST_ENTRY*)) : NULL;
+	}
+	if (k && !v) {
+		for (i = 0; i < k; i++)
+			free_history_entry(older[i]);
+		free(older);
+		free(hs);
+		return 0;
+	}
+	if (k) {
+		for (i = 0; i < k; i++)
+			v[i] = older[k - 1 - i];
+		if (hs->length)
+			memcpy(v + k, hs->entries, hs->length * sizeof(HIST_ENTRY*));
+		v[hs->length + k] = NULL;
+		/* The state refers to the array of libreadline rather than to a copy of it */
+		free(hs->entries);
+		hs->entries = v;
+		hs->length += (int) k;
+		hs->offset += (int) k;
+		hs->size = hs->length + 1;
+		history_set_history_state(hs);
+		free(hs);
+		/* The mirror and the total size are rebuilt when needed */
+		h->mirror.valid = 0;
+		h->counted = -1;
+		log->cursor = pos;
+	} else if (ok)
+		log->cursor = 0;
+	free(older);
+	return ok;
+}
+
+/**
+ * Materialises the next chunk of the history log of the current history list when readline has navigated
+ * to the oldest entry the list has, called before every key is read
+ */
+static void histlog_navigated(void)
+{
+	if (globalHist && globalHist->log.attached && globalHist->log.cursor && where_history() == 0)
+		histlog_load(globalHist, globalHist->log.chunk);
+}
+
+/**
+ * Called once libreadline has read a line: the entries navigated to while it was edited may have been
+ * replaced with the edited lines, which the mirror then has to be checked for and the total size recounted
+ */
+static void hist_edited(void)
+{
+	if (globalHist) {
+		globalHist->mirror.suspect = 1;
+		globalHist->counted = -1;
+	}
+}
+
+/**
+ * Counts the entries of a history log not materialised yet, from the newest one back to the oldest of the first
+ * want ones starting with or containing the text. Returns 0 if none of them do
+ */
+static size_t histlog_scan(const histlog_t *log, const char *text, size_t len, int substring, size_t want)
+{
+	size_t pos = log->cursor, n = 0, need = 0, found = 0, linelen, ts, tslen;
+	if (!log->attached)
+		return 0;
+	while (found < want && histlog_prev(log, &pos, &linelen, &ts, &tslen)) {
+		const char *line = log->map + pos;
+		n++;
+		if (linelen >= len && (substring ? memmem(line, linelen, text, len) != NULL : memcmp(line, text, len) == 0)) {
+			found++;
+			need = n;
+		}
+	}
+	return need;
+}
+
+/**
+ * Appends a line added to the history list to the history log, if it's attached for appending
+ * The line goes with a single write, so the lines of the processes sharing the log don't interleave.
+ * A failed write only loses the line from the log
+ */
+static void histlog_append(histlog_t *log, const char *str, size_t len)
+{
+	if (!log->attached || !log->append)
+		return;
+	char stamp[32];
+	struct iovec iov[3];
+	int n = 0;
+	/* Timestamps are only told from lines by history_comment_char */
+	if (history_write_timestamps && history_comment_char) {
+		iov[n].iov_base = stamp;
+		iov[n++].iov_len = (size_t) snprintf(stamp, sizeof(stamp), "%c%lu\n", history_comment_char, (unsigned long) time(NULL));
+	}
+	iov[n].iov_base = (void*) str;
+	iov[n++].iov_len = len;
+	iov[n].iov_base = (void*) "\n";
+	iov[n++].iov_len = 1;
+	while (writev(log->fd, iov, n) < 0 && errno == EINTR)
+		;
+}
+
+/**
+ * rl_prep_term_function used for sessions: puts the input terminal of the current session into
+ * the character mode, saving its settings in the session rather than in libreadline globals
+ */
+static void session_prepterm(int meta)
+{
+	session_t *s = globalSession;
+	struct termios tio;
+	(void) meta;
+	if (!s || s->prepped || tcgetattr(fileno(s->in), &s->tio))
+		return;
+	tio = s->tio;
+	tio.c_lflag &= ~(ICANON | ECHO);
+	tio.c_iflag &= ~(ICRNL | INLCR);
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+	if (!tcsetattr(fileno(s->in), TCSADRAIN, &tio))
+		s->prepped = 1;
+}
+
+/**
+ * rl_deprep_term_function used for sessions: restores the settings saved by session_prepterm
+ */
+static void session_deprepterm(void)
+{
+	session_t *s = globalSession;
+	if (s && s->prepped) {
+		tcsetattr(fileno(s->in), TCSADRAIN, &s->tio);
+		s->prepped = 0;
+	}
+}
+
+/**
+ * Saves the line state of a session with a callback handler and hands libreadline an empty line instead
+ * Returns 0 if out of memory
+ */
+static int session_save(session_t *s)
+{
+	struct readline_state blank;
+	char *buf = (char*) malloc(256);
+	if (!buf)
+		return 0;
+	rl_save_state(&s->state);
+	s->hasstate = 1;
+	/* The buffer, the prompt and the undo list belong to the saved state now */
+	blank = s->state;
+	buf[0] = '\0';
+	blank.buffer = buf;
+	blank.buflen = 256;
+	blank.point = blank.end = blank.mark = 0;
+	blank.ul = NULL;
+	blank.prompt = NULL;
+	blank.done = 0;
+	blank.rlstate &= RL_STATE_INITIALIZED | RL_STATE_TTYCSAVED;
+	blank.kseqlen = 0;
+	blank.pendingin = 0;
+	blank.macro = NULL;
+	rl_restore_state(&blank);
+	rl_set_prompt("");
+	return 1;
+}
+
+/**
+ * Restores the line state saved by session_save, dropping the current line of libreadline,
+ * and redraws the line on the terminal of the session
+ */
+static void session_restore(session_t *s)
+{
+	char *prompt;
+	rl_free_undo_list();
+	free(rl_line_buffer);
+	free(rl_prompt);
+	rl_restore_state(&s->state);
+	s->hasstate = 0;
+	/* The expanded prompt is kept by libreadline apart from the state */
+	prompt = rl_prompt;
+	rl_prompt = NULL;
+	rl_set_prompt(prompt);
+	free(prompt);
+	/* The display state describes the terminal drawn last, draw the line again from the start of the row */
+	fputc('\r', rl_outstream);
+	rl_forced_update_display();
+}
+
+/**
+ * Points libreadline to the streams of a session, or to the default streams if s is NULL
+ * The line state of a session with a callback handler is saved and restored on the way
+ * Returns 0 if out of memory
+ */
+static int session_switch(session_t *s)
+{
+	session_t *cur = globalSession;
+	if (cur == s)
+		return 1;
+	if (cur) {
+		if (cur->installed && !cur->hasstate && !session_save(cur))
+			return 0;
+		cur->name = (char*) rl_readline_name;
+	} else {
+		globalDefaultIn = rl_instream;
+		globalDefaultOut = rl_outstream;
+		globalDefaultName = rl_readline_name;
+		globalDefaultPrep = rl_prep_term_function;
+		globalDefaultDeprep = rl_deprep_term_function;
+	}
+	globalSession = s;
+	if (s) {
+		rl_instream = s->in;
+		rl_outstream = s->out;
+		rl_readline_name = s->name;
+		rl_prep_term_function = session_prepterm;
+		rl_deprep_term_function = session_deprepterm;
+	} else {
+		rl_instream = globalDefaultIn;
+		rl_outstream = globalDefaultOut;
+		rl_readline_name = globalDefaultName;
+		rl_prep_term_function = globalDefaultPrep;
+		rl_deprep_term_function = globalDefaultDeprep;
+	}
+	/* The terminals may differ in size */
+	if (RL_ISSTATE(RL_STATE_INITIALIZED) && rl_instream)
+		rl_reset_screen_size();
+	if (s && s->hasstate)
+		session_restore(s);
+	return 1;
+}
+
+/**
+ * Acquires libreadline for a context, to be called before using libreadline or the history list
+ * and paired with ctx_leave. The streams and the history list of the session the context works with
+ * (see lua_sessioncall) are switched in. Calls can be nested, but a context can't take libreadline over
+ * while another one is in the middle of using it on the same thread
+ */
+static void ctx_enter(lua_State *L, context_t *ctx)
+{
+	pthread_once(&globalLockOnce, lock_init);
+	pthread_mutex_lock(&globalLock);
+	if (globalCtx != ctx && globalCtx && globalCtx->depth) {
+		pthread_mutex_unlock(&globalLock);
+		luaL_error(L, "readline is in use by another Lua state");
+	}
+	globalCtx = ctx;
+	if (ctx->depth) {
+		if (ctx->session != globalSession) {
+			pthread_mutex_unlock(&globalLock);
+			luaL_error(L, "readline is in use by another session");
+		}
+	} else {
+		if (!session_switch(ctx->session)) {
+			pthread_mutex_unlock(&globalLock);
+			luaL_error(L, "Out of memory");
+		}
+		hist_switch(ctx->session ? &ctx->session->hist : &ctx->ownhist);
+		ctx->hist = globalHist;
+		ctx->L = L;
+	}
+	ctx->depth++;
+}
+
+/**
+ * Releases libreadline acquired by ctx_enter
+ */
+static void ctx_leave(context_t *ctx)
+{
+	ctx->depth--;
+	if (!ctx->depth && ctx->closing != LUA_NOREF)
+		ctx_closesession(ctx);
+	pthread_mutex_unlock(&globalLock);
+}
+
+/**
+ * Releases libreadline as many times as it has been acquired with ctx_enter over the given depth
+ * That's for an error raised between ctx_enter and ctx_leave, such as a memory error or one raised
+ * by a metamethod of an options table, not to leave the lock held
+ */
+static void ctx_unwind(context_t *ctx, int depth)
+{
+	while (ctx->depth > depth)
+		ctx_leave(ctx);
+}
+
+/**
+ * Calls the function below nargs arguments on top of the stack like lua_call does, but releases libreadline
+ * acquired by the function and left acquired by an error it raises before raising the error again
+ */
+static void ctx_call(lua_State *L, context_t *ctx, int nargs, int nres)
+{
+	int depth = ctx->depth;
+	if (lua_pcall(L, nargs, nres, 0)) {
+		ctx_unwind(ctx, depth);
+		lua_error(L);
+	}
+}
+
+/**
+ * Calls the library function in the second upvalue with the arguments through ctx_call
+ * The library functions taking libreadline with ctx_enter are registered wrapped in it, see pushguarded
+ * Upvalues:
+ * 1) The context
+ * 2) The library function
+ */
+static int lua_guarded(lua_State *L)
+{
+	lua_checkstack(L, 1);
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_insert(L, 1);
+	ctx_call(L, getcontext(L), lua_gettop(L) - 1, LUA_MULTRET);
+	return lua_gettop(L);
+}
+
+/**
+ * Pushes a library function with the context at the given stack index as its upvalue, wrapped in lua_guarded
+ */
+static void pushguarded(lua_State *L, int ctxidx, lua_CFunction fn)
+{
+	if (ctxidx < 0)
+		ctxidx = lua_gettop(L) + ctxidx + 1;
+	lua_checkstack(L, 2);
+	lua_pushvalue(L, ctxidx);
+	lua_pushvalue(L, ctxidx);
+	lua_pushcclosure(L, fn, 1);
+	lua_pushcclosure(L, lua_guarded, 2);
+}
+
+/**
+ * Records the error on top of the stack raised by Lua code called from libreadline and makes
+ * libreadline return, so that the error doesn't unwind through its frames. ctx_rethrow raises it again
+ */
+static void ctx_fail(context_t *ctx)
+{
+	if (ctx->failed)
+		lua_pop(ctx->L, 1);
+	else {
+		setref(ctx->L, &ctx->error);
+		ctx->failed = 1;
+	}
+	rl_done = 1;
+}
+
+/**
+ * Raises the error recorded by ctx_fail, if any, to be called after ctx_leave
+ */
+static void ctx_rethrow(lua_State *L, context_t *ctx)
+{
+	if (!ctx->failed)
+		return;
+	ctx->failed = 0;
+	getref(L, ctx->error);
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->error);
+	ctx->error = LUA_NOREF;
+	lua_error(L);
+}
+
+/**
+ * An iterator that always returns nil
+ */
+static int lua_returnnil(lua_State *L)
+{
+	return 0;
+}
+
+/**
+ * A generator that always returns an empty iterator
+ */
+static int lua_niliterator(lua_State *L)
+{
+	lua_pushcfunction(L, lua_returnnil);
+	return 1;
+}
+
+/**
+ * The iterator function to be returned by lua_ipairsiterator
+ * Upvalues:
+ * 1-3) The return values from ipairs or the last iterator call
+ * 4) The prefix to filter iterated values to start with
+ */
+static int lua_iterstep(lua_State *L) {
+	stats_t *st = globalCtx && globalCtx->stats.enabled ? &globalCtx->stats : NULL;
+	lua_checkstack(L, 3);
+	size_t len;
+	/* Get the prefix as string */
+	const char *pref = lua_tolstring(L, lua_upvalueindex(4), &len);
+	for (;;) {
+		/* Simulate the "for" operator behavior */
+		lua_pushvalue(L, lua_upvalueindex(1));
+		lua_pushvalue(L, lua_upvalueindex(2));
+		lua_pushvalue(L, lua_upvalueindex(3));
+		lua_call(L, 2, 2);
+		/* Exchange the "key" and "value" returned values on stack */
+		lua_insert(L, -2);
+		/* Store the "key" returned */
+		lua_replace(L, lua_upvalueindex(3));
+		size_t rlen=0;
+		const char *res=NULL;
+		/* If nil was returned, we have finished the iteration - forward it */
+		if (lua_isnil(L, -1))
+			return 1;
+		/* Get the string returned */
+		res = lua_tolstring(L, -1, &rlen);
+		if (st)
+			st->scanned++;
+		/* Check if it starts with the prefix supplied when creating the iterator */
+		if (rlen>=len && strncmp(pref, res, len)==0) {
+			/* If it matches, return the string */
+			if (st)
+				st->matched++;
+			return 1;
+		}
+		/* Clear the unmatched value off the stack and fetch a new one */
+		lua_pop(L, 1);
+	}
+}
+
+/**
+ * Generator function that calls ipairs for a given table and wraps the iterator returned by it in a closure
+ * Upvalues:
+ * 1) The prefix to filter the iterated values to start with
+ */
+static int lua_ipairsiterator(lua_State *L) {
+	lua_checkstack(L, 2);
+	lua_getglobal(L, "ipairs");
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_call(L, 1, 3);
+	lua_pushvalue(L, 1);
+	lua_pushcclosure(L, lua_iterstep, 4);
+	return 1;
+}
+
+/**
+ * Returns the userdata at the given stack index if it has the given metatable, NULL otherwise
+ * Lua 5.1 compatibility replacement for luaL_testudata
+ */
+static void* testudata(lua_State *L, int idx, const char *tname)
+{
+	void *p = lua_touserdata(L, idx);
+	if (!p || !lua_getmetatable(L, idx))
+		return NULL;
+	luaL_getmetatable(L, tname);
+	if (!lua_rawequal(L, -1, -2))
+		p = NULL;
+	lua_pop(L, 2);
+	return p;
+}
+
+/**
+ * Returns the i-th string of an index in sorted order
+ */
+static const char* index_get(const index_t *idx, size_t i)
+{
+	return idx->blob + idx->offs[i];
+}
+
+/**
+ * Finds the position of the first string of an index not less than the prefix
+ * All the strings starting with the prefix are stored contiguously from this position
+ */
+static size_t index_lowerbound(const index_t *idx, const char *pref)
+{
+	size_t lo = 0, hi = idx->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (strcmp(index_get(idx, mid), pref) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * qsort comparator for an array of string pointers
+ */
+static int cmpstrptr(const void *a, const void *b)
+{
+	return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+/**
+ * Sorts the strings copied into the blob of an index and stores their offsets skipping duplicates
+ */
+static void index_sort(index_t *idx, const char **ptrs, size_t count)
+{
+	size_t i;
+	qsort(ptrs, count, sizeof(const char*), cmpstrptr);
+	idx->count = 0;
+	for (i = 0; i < count; i++)
+		if (!idx->count || strcmp(ptrs[i], index_get(idx, idx->count - 1)) != 0)
+			idx->offs[idx->count++] = (uint32_t) (ptrs[i] - idx->blob);
+}
+
+/**
+ * Initializes an empty index
+ */
+static void index_init(index_t *idx)
+{
+	idx->blob = NULL;
+	idx->offs = NULL;
+	idx->count = 0;
+	idx->masks = NULL;
+	idx->used = 0;
+	idx->blobcap = 0;
+	idx->offcap = 0;
+	idx->garbage = 0;
+	idx->map = NULL;
+	idx->mapsize = 0;
+}
+
+/**
+ * Frees the memory of an index, or unmaps the file it has been opened from
+ */
+static void index_free(index_t *idx)
+{
+	if (idx->map)
+		munmap(idx->map, idx->mapsize);
+	else {
+		free(idx->blob);
+		free(idx->offs);
+	}
+	free(idx->masks);
+	index_init(idx);
+}
+
+/**
+ * Fills an index with the string values of a Lua array, sorting them and dropping duplicates
+ * Returns zero if memory allocation failed
+ */
+static int index_build(lua_State *L, index_t *idx, int tbl)
+{
+	size_t n = lua_rawlen(L, tbl), total = 0, i, count = 0;
+	lua_checkstack(L, 1);
+	/* Get the size of the blob needed */
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, tbl, i);
+		if (lua_type(L, -1) == LUA_TSTRING || lua_type(L, -1) == LUA_TNUMBER) {
+			size_t len;
+			lua_tolstring(L, -1, &len);
+			total += len + 1;
+		}
+		lua_pop(L, 1);
+	}
+	index_init(idx);
+	idx->blob = (char*) malloc(total ? total : 1);
+	idx->offs = (uint32_t*) malloc((n ? n : 1) * sizeof(uint32_t));
+	const char **ptrs = (const char**) malloc((n ? n : 1) * sizeof(const char*));
+	if (!idx->blob || !idx->offs || !ptrs || total > UINT32_MAX) {
+		free(ptrs);
+		return 0;
+	}
+	/* Copy the strings into the blob */
+	char *p = idx->blob;
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, tbl, i);
+		if (lua_type(L, -1) == LUA_TSTRING || lua_type(L, -1) == LUA_TNUMBER) {
+			size_t len;
+			const char *str = lua_tolstring(L, -1, &len);
+			memcpy(p, str, len);
+			p[len] = '\0';
+			ptrs[count++] = p;
+			p += len + 1;
+		}
+		lua_pop(L, 1);
+	}
+	idx->used = idx->blobcap = total;
+	idx->offcap = n;
+	index_sort(idx, ptrs, count);
+	free(ptrs);
+	return 1;
+}
+
+/**
+ * Fills an index with copies of a vector of C strings, sorting them and dropping duplicates
+ * Returns zero if memory allocation failed
+ */
+static int index_fromvector(index_t *idx, char *const *v, size_t n)
+{
+	size_t total = 0, i;
+	for (i = 0; i < n; i++)
+		total += strlen(v[i]) + 1;
+	index_init(idx);
+	idx->blob = (char*) malloc(total ? total : 1);
+	idx->offs = (uint32_t*) malloc((n ? n : 1) * sizeof(uint32_t));
+	const char **ptrs = (const char**) malloc((n ? n : 1) * sizeof(const char*));
+	if (!idx->blob || !idx->offs || !ptrs || total > UINT32_MAX) {
+		free(ptrs);
+		return 0;
+	}
+	char *p = idx->blob;
+	for (i = 0; i < n; i++) {
+		size_t len = strlen(v[i]) + 1;
+		memcpy(p, v[i], len);
+		ptrs[i] = p;
+		p += len;
+	}
+	idx->used = idx->blobcap = total;
+	idx->offcap = n;
+	index_sort(idx, ptrs, n);
+	free(ptrs);
+	return 1;
+}
+
+/**
+ * Makes room in an index for a string of len bytes with its NUL and another offset
+ * Returns zero if memory allocation failed or the blob would outgrow the 32-bit offsets
+ */
+static int index_reserve(index_t *idx, size_t len)
+{
+	size_t need = idx->used + len + 1, cap;
+	if (need > UINT32_MAX)
+		return 0;
+	if (need > idx->blobcap) {
+		for (cap = idx->blobcap ? idx->blobcap : 4096; cap < need; cap *= 2)
+			;
+		char *blob = (char*) realloc(idx->blob, cap);
+		if (!blob)
+			return 0;
+		idx->blob = blob;
+		idx->blobcap = cap;
+	}
+	if (idx->count + 1 > idx->offcap) {
+		cap = idx->offcap ? idx->offcap * 2 : 256;
+		uint32_t *offs = (uint32_t*) realloc(idx->offs, cap * sizeof(uint32_t));
+		if (!offs)
+			return 0;
+		idx->offs = offs;
+		idx->offcap = cap;
+	}
+	return 1;
+}
+
+/**
+ * Copies a string to the end of the blob of an index without adding it to the sorted offsets
+ * Returns zero if memory allocation failed
+ */
+static int index_append(index_t *idx, const char *str, size_t len)
+{
+	if (!index_reserve(idx, len))
+		return 0;
+	memcpy(idx->blob + idx->used, str, len);
+	idx->blob[idx->used + len] = '\0';
+	idx->used += len + 1;
+	return 1;
+}
+
+/**
+ * Adds the strings appended to the blob of an index from the offset first on to the sorted offsets
+ * Returns zero if memory allocation failed, the new strings are dropped then
+ */
+static int index_merge(index_t *idx, size_t first)
+{
+	size_t n = idx->count, i, live = 0;
+	const char *p;
+	for (p = idx->blob + first; p < idx->blob + idx->used; p += strlen(p) + 1)
+		n++;
+	if (n == idx->count)
+		return 1;
+	const char **ptrs = (const char**) malloc((n ? n : 1) * sizeof(const char*));
+	uint32_t *offs = n > idx->offcap ? (uint32_t*) realloc(idx->offs, n * sizeof(uint32_t)) : idx->offs;
+	if (!ptrs || !offs) {
+		free(ptrs);
+		if (offs)
+			idx->offs = offs;
+		idx->used = first;
+		return 0;
+	}
+	if (n > idx->offcap) {
+		idx->offs = offs;
+		idx->offcap = n;
+	}
+	for (i = 0; i < idx->count; i++)
+		ptrs[i] = index_get(idx, i);
+	for (p = idx->blob + first; p < idx->blob + idx->used; p += strlen(p) + 1)
+		ptrs[i++] = p;
+	index_sort(idx, ptrs, n);
+	free(ptrs);
+	/* The duplicates dropped by index_sort are garbage */
+	for (i = 0; i < idx->count; i++)
+		live += strlen(index_get(idx, i)) + 1;
+	idx->garbage = idx->used - live;
+	return 1;
+}
+
+/**
+ * Copies the strings of an index into a new blob without the garbage left by the removed ones
+ * Keeps the index as is if memory allocation failed
+ */
+static void index_compact(index_t *idx)
+{
+	size_t size = idx->used - idx->garbage, i, len;
+	char *blob = (char*) malloc(size ? size : 1), *p = blob;
+	if (!blob)
+		return;
+	for (i = 0; i < idx->count; i++) {
+		len = strlen(index_get(idx, i)) + 1;
+		memcpy(p, index_get(idx, i), len);
+		idx->offs[i] = (uint32_t) (p - blob);
+		p += len;
+	}
+	free(idx->blob);
+	idx->blob = blob;
+	idx->used = idx->blobcap = size;
+	idx->garbage = 0;
+}
+
+/**
+ * Inserts a string into an index at its sorted position
+ * Returns 1 if it has been added, 0 if the index has it already and -1 if memory allocation failed
+ */
+static int index_insert(index_t *idx, const char *str)
+{
+	size_t pos = index_lowerbound(idx, str), len = strlen(str);
+	if (pos < idx->count && strcmp(index_get(idx, pos), str) == 0)
+		return 0;
+	size_t off = idx->used;
+	if (!index_append(idx, str, len))
+		return -1;
+	memmove(idx->offs + pos + 1, idx->offs + pos, (idx->count - pos) * sizeof(uint32_t));
+	idx->offs[pos] = (uint32_t) off;
+	idx->count++;
+	return 1;
+}
+
+/**
+ * Removes a string from an index, compacting the blob once most of it is garbage
+ * Returns zero if the index doesn't have the string
+ */
+static int index_remove(index_t *idx, const char *str)
+{
+	size_t pos = index_lowerbound(idx, str);
+	if (pos >= idx->count || strcmp(index_get(idx, pos), str) != 0)
+		return 0;
+	idx->garbage += strlen(str) + 1;
+	idx->count--;
+	memmove(idx->offs + pos, idx->offs + pos + 1, (idx->count - pos) * sizeof(uint32_t));
+	if (idx->garbage >= INDEX_COMPACT && idx->garbage > idx->used / 2)
+		index_compact(idx);
+	return 1;
+}
+
+/**
+ * Writes an index to a file in the format of readline.compiledict, the strings in the sorted order
+ * The file is written under a temporary name and renamed, so the processes having the old one mapped keep it intact
+ * Returns 0 or the error number
+ */
+static int index_compile(const index_t *idx, const char *path)
+{
+	size_t i, len, total = 0;
+	uint32_t *offs = (uint32_t*) malloc((idx->count ? idx->count : 1) * sizeof(uint32_t));
+	char *tmp = (char*) malloc(strlen(path) + 32);
+	if (!offs || !tmp) {
+		free(offs);
+		free(tmp);
+		return ENOMEM;
+	}
+	for (i = 0; i < idx->count; i++) {
+		offs[i] = (uint32_t) total;
+		total += strlen(index_get(idx, i)) + 1;
+	}
+	dictheader_t h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, DICT_MAGIC, sizeof(h.magic));
+	h.order = DICT_ORDER;
+	h.count = (uint32_t) idx->count;
+	h.bloblen = (uint32_t) total;
+	sprintf(tmp, "%s.%ld.tmp", path, (long) getpid());
+	int err = 0;
+	FILE *f = fopen(tmp, "wb");
+	if (!f)
+		err = errno;
+	else {
+		int ok = fwrite(&h, sizeof(h), 1, f) == 1 && (!idx->count || fwrite(offs, sizeof(uint32_t), idx->count, f) == idx->count);
+		for (i = 0; ok && i < idx->count; i++) {
+			len = strlen(index_get(idx, i)) + 1;
+			ok = fwrite(index_get(idx, i), 1, len, f) == len;
+		}
+		if (!ok)
+			err = errno ? errno : EIO;
+		if (fclose(f) && !err)
+			err = errno;
+		if (!err && rename(tmp, path))
+			err = errno;
+		if (err)
+			unlink(tmp);
+	}
+	free(offs);
+	free(tmp);
+	return err;
+}
+
+/**
+ * Opens a file written by index_compile as an index, mapping it into memory read-only
+ * The offsets are checked to point into the blob, so a damaged file can't make the index read past it
+ * Returns 0, the error number, or -1 if the file is not a compiled dictionary
+ */
+static int index_map(index_t *idx, const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return errno;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		int err = errno;
+		close(fd);
+		return err;
+	}
+	size_t size = (size_t) st.st_size, i;
+	void *map = size >= sizeof(dictheader_t) ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+	int err = map == MAP_FAILED ? errno : 0;
+	close(fd);
+	if (err)
+		return err;
+	if (!map)
+		return -1;
+	const dictheader_t *h = (const dictheader_t*) map;
+	uint32_t *offs = (uint32_t*) ((char*) map + sizeof(dictheader_t));
+	char *blob = NULL;
+	int valid = memcmp(h->magic, DICT_MAGIC, sizeof(h->magic)) == 0 && h->order == DICT_ORDER
+		&& (size - sizeof(dictheader_t)) / sizeof(uint32_t) >= h->count
+		&& size - sizeof(dictheader_t) - (size_t) h->count * sizeof(uint32_t) >= h->bloblen;
+	if (valid) {
+		blob = (char*) (offs + h->count);
+		valid = h->count == 0 || (h->bloblen > 0 && blob[h->bloblen - 1] == '\0');
+	}
+	for (i = 0; valid && i < h->count; i++)
+		valid = offs[i] < h->bloblen;
+	if (!valid) {
+		munmap(map, size);
+		return -1;
+	}
+	index_free(idx);
+	idx->map = map;
+	idx->mapsize = size;
+	idx->blob = blob;
+	idx->offs = offs;
+	idx->count = h->count;
+	idx->used = idx->blobcap = h->bloblen;
+	idx->offcap = h->count;
+	return 0;
+}
+
+/**
+ * Replaces the mapping of an index opened from a compiled dictionary with a copy of it, so it can be changed
+ * Returns zero if memory allocation failed
+ */
+static int index_unshare(index_t *idx)
+{
+	if (!idx->map)
+		return 1;
+	char *blob = (char*) malloc(idx->used ? idx->used : 1);
+	uint32_t *offs = (uint32_t*) malloc((idx->count ? idx->count : 1) * sizeof(uint32_t));
+	if (!blob || !offs) {
+		free(blob);
+		free(offs);
+		return 0;
+	}
+	memcpy(blob, idx->blob, idx->used);
+	memcpy(offs, idx->offs, idx->count * sizeof(uint32_t));
+	munmap(idx->map, idx->mapsize);
+	idx->map = NULL;
+	idx->mapsize = 0;
+	idx->blob = blob;
+	idx->offs = offs;
+	return 1;
+}
+
+/**
+ * The iterator function to be returned for an index
+ * Upvalues:
+ * 1) The index userdata
+ * 2) The position of the next string to check
+ * 3) The prefix to filter the strings to start with
+ */
+static int lua_indexstep(lua_State *L)
+{
+	index_t *idx = (index_t*) lua_touserdata(L, lua_upvalueindex(1));
+	size_t pos = (size_t) lua_tonumber(L, lua_upvalueindex(2));
+	size_t len;
+	const char *pref = lua_tolstring(L, lua_upvalueindex(3), &len);
+	/* The matches are contiguous, so the first mismatch finishes the iteration */
+	if (pos >= idx->count || strncmp(index_get(idx, pos), pref, len) != 0)
+		return 0;
+	lua_pushnumber(L, (lua_Number) (pos + 1));
+	lua_replace(L, lua_upvalueindex(2));
+	lua_pushstring(L, index_get(idx, pos));
+	return 1;
+}
+
+/**
+ * Pushes an iterator over the strings of an index starting with the prefix
+ */
+static void index_pushiterator(lua_State *L, int ud, const char *pref)
+{
+	index_t *idx = (index_t*) lua_touserdata(L, ud);
+	lua_checkstack(L, 3);
+	lua_pushvalue(L, ud);
+	lua_pushnumber(L, (lua_Number) index_lowerbound(idx, pref));
+	lua_pushstring(L, pref);
+	lua_pushcclosure(L, lua_indexstep, 3);
+}
+
+/**
+ * Generator function for an index
+ * Upvalues:
+ * 1) The index userdata
+ */
+static int lua_indexgenerator(lua_State *L)
+{
+	index_pushiterator(L, lua_upvalueindex(1), luaL_checkstring(L, 1));
+	return 1;
+}
+
+/**
+ * readline.index(tbl) - builds a sorted prefix index of the strings in an array
+ * The index can be passed to readline.readline as a generator,
+ * or called with a prefix to get an iterator over the strings starting with it
+ */
+static int lua_newindex(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_checkstack(L, 2);
+	index_t *idx = (index_t*) lua_newuserdata(L, sizeof(index_t));
+	index_init(idx);
+	luaL_getmetatable(L, INDEX_METATABLE);
+	lua_setmetatable(L, -2);
+	if (!index_build(L, idx, 1))
+		return luaL_error(L, "Out of memory");
+	return 1;
+}
+
+/**
+ * index(prefix) - returns an iterator over the strings of the index starting with the prefix
+ */
+static int lua_indexcall(lua_State *L)
+{
+	luaL_checkudata(L, 1, INDEX_METATABLE);
+	index_pushiterator(L, 1, luaL_checkstring(L, 2));
+	return 1;
+}
+
+/**
+ * #index - returns the number of distinct strings in the index
+ */
+static int lua_indexlen(lua_State *L)
+{
+	index_t *idx = (index_t*) luaL_checkudata(L, 1, INDEX_METATABLE);
+	lua_pushnumber(L, (lua_Number) idx->count);
+	return 1;
+}
+
+/**
+ * Index garbage collection metamethod, frees the C memory
+ * The context is the upvalue: when the Lua state is closed, the index may be finalised before the context,
+ * so the prefetch from it is stopped first
+ */
+static int lua_indexgc(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	index_t *idx = (index_t*) luaL_checkudata(L, 1, INDEX_METATABLE);
+	if (ctx && ctx->prefetch.idx == idx) {
+		prefetch_reset(&ctx->prefetch);
+		ctx->prefetch.idx = NULL;
+	}
+	index_free(idx);
+	return 0;
+}
+
+/**
+ * Allocates memory to copy a string and copies it
+ */
+static char* clonestr(const char *srcstr)
+{
+	size_t len = strlen(srcstr)+1;
+	char *dststr = (char*) malloc(len);
+	strlcpy(dststr, srcstr, len);
+	return dststr;
+}
+
+/**
+ * Returns the current CLOCK_MONOTONIC time in nanoseconds
+ */
+static uint64_t clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Returns the current CLOCK_MONOTONIC time in milliseconds
+ */
+static uint64_t clock_ms(void)
+{
+	return clock_ns() / 1000000;
+}
+
+/**
+ * Calls a generator function or an iterator on the Lua thread of the context the way lua_pcall does,
+ * with nargs arguments and a single result, timing the call if the statistics are enabled
+ * init tells if it's a generator function producing the candidates rather than an iterator step
+ */
+static int gen_pcall(context_t *ctx, int nargs, int init)
+{
+	stats_t *st = &ctx->stats;
+	if (!st->enabled)
+		return lua_pcall(ctx->L, nargs, 1, 0);
+	uint64_t start = clock_ns();
+	int res = lua_pcall(ctx->L, nargs, 1, 0);
+	if (init) {
+		st->inits++;
+		st->initns += clock_ns() - start;
+	} else {
+		st->steps++;
+		st->stepns += clock_ns() - start;
+	}
+	return res;
+}
+
+/**
+ * Pushes the arguments of a generator function: the text to complete, the whole line, the positions
+ * of the first and the last character of the word in the line, and the number of characters before the cursor
+ * Returns the number of the values pushed
+ */
+static int pushgenargs(context_t *ctx, const char *text)
+{
+	lua_State *L = ctx->L;
+	lua_checkstack(L, 5);
+	lua_pushstring(L, text);
+	if (rl_line_buffer)
+		lua_pushlstring(L, rl_line_buffer, (size_t) rl_end);
+	else
+		lua_pushstring(L, text);
+	lua_pushinteger(L, ctx->wordstart + 1);
+	lua_pushinteger(L, ctx->wordend);
+	lua_pushinteger(L, rl_point);
+	return 5;
+}
+
+/**
+ * Generator init function
+ * Calls the generator function to get the iterator function and stores the iterator function to the context
+ * Returns zero if the generator has raised an error
+ */
+static int lua_initgenerator(context_t *ctx, const char *text)
+{
+	lua_State *L = ctx->L;
+	lua_checkstack(L, 1);
+	getref(L, ctx->generator);
+	if (gen_pcall(ctx, pushgenargs(ctx, text), 1)) {
+		ctx_fail(ctx);
+		return 0;
+	}
+	setref(L, &ctx->iterator);
+	return 1;
+}
+
+/**
+ * Generator step function
+ * Calls the iterator function and returns its return value as string
+ * Returns NULL when the iteration is over or the iterator has raised an error
+ */
+static char* lua_stepgenerator(context_t *ctx)
+{
+	lua_State *L = ctx->L;
+	lua_checkstack(L, 1);
+	/* Get the generator function that was stored by lua_initgenerator */
+	getref(L, ctx->iterator);
+	/* Call the generator function */
+	if (gen_pcall(ctx, 0, 0)) {
+		ctx_fail(ctx);
+		return NULL;
+	}
+	if (lua_isnil(L, -1)) {
+		/* If the generator function returned nil, return NULL */
+		lua_pop(L, 1);
+		return NULL;
+	}
+	size_t len;
+	/* Get the string returned by the generator function */
+	const char *str = lua_tolstring(L, -1, &len);
+	/* Allocate memory to copy the string */
+	char *newstr = (char*) malloc(len+1);
+	/* Copy the returned string */
+	strncpy(newstr, str, len+1);
+	lua_pop(L, 1);
+	/* Return the copied string */
+	return newstr;
+}
+
+/**
+ * Initializes an empty vector of matches
+ */
+static void matches_init(matches_t *m)
+{
+	m->v = NULL;
+	m->n = 0;
+	m->cap = 0;
+	m->scanned = 0;
+	m->limit = 0;
+	m->deadline = 0;
+	m->truncated = TRUNCATED_NONE;
+}
+
+/**
+ * Frees a vector of matches with all the strings in it
+ */
+static void matches_free(matches_t *m)
+{
+	size_t i;
+	for (i = 1; i <= m->n; i++)
+		free(m->v[i]);
+	free(m->v);
+	matches_init(m);
+}
+
+/**
+ * Appends a copy of a string to a vector of matches
+ * Returns zero if memory allocation failed
+ */
+static int matches_add(matches_t *m, const char *str, size_t len)
+{
+	/* Keep room for the common prefix slot and the terminating NULL */
+	if (m->n + 2 >= m->cap) {
+		size_t cap = m->cap ? m->cap * 2 : 16;
+		char **v = (char**) realloc(m->v, cap * sizeof(char*));
+		if (!v)
+			return 0;
+		m->v = v;
+		m->cap = cap;
+	}
+	char *newstr = (char*) malloc(len+1);
+	if (!newstr)
+		return 0;
+	memcpy(newstr, str, len);
+	newstr[len] = '\0';
+	m->v[++m->n] = newstr;
+	return 1;
+}
+
+/**
+ * Checks if the input is being cancelled by SIGINT, so that a completion should stop
+ * The signal may still be pending in libreadline, which handles it the next time it reads the input
+ */
+static int completion_interrupted(void)
+{
+	return globalArmed && (globalInterrupted || rl_pending_signal() == SIGINT);
+}
+
+/**
+ * Checks if the deadline of a vector of matches has passed, marking the vector truncated if it has
+ * A vector of matches being collected while the input is cancelled is considered expired as well
+ */
+static int matches_expired(matches_t *m)
+{
+	if (completion_interrupted())
+		return 1;
+	if (!m->deadline || clock_ms() < m->deadline)
+		return 0;
+	m->truncated = TRUNCATED_TIMEOUT;
+	return 1;
+}
+
+/**
+ * Checks if another match fits under the limit of a vector of matches, marking the vector truncated otherwise
+ * The deadline is only checked every DEADLINE_STRIDE matches, which are cheap to collect in C
+ */
+static int matches_room(matches_t *m)
+{
+	if (m->limit && m->n >= m->limit) {
+		m->truncated = TRUNCATED_LIMIT;
+		return 0;
+	}
+	return (m->n % DEADLINE_STRIDE) || !matches_expired(m);
+}
+
+/**
+ * Drops the matches over the limit of a vector of matches collected without checking it
+ */
+static void matches_cap(matches_t *m)
+{
+	while (m->limit && m->n > m->limit) {
+		free(m->v[m->n--]);
+		m->truncated = TRUNCATED_LIMIT;
+	}
+}
+
+/**
+ * Finishes a vector of matches and hands it over to the caller
+ * Fills the first slot with the longest common prefix of the matches, the way rl_completion_matches does
+ * Returns NULL if there are no matches or memory allocation failed
+ */
+static char** matches_finish(matches_t *m)
+{
+	char **v = m->v;
+	if (!m->n)
+		return NULL;
+	v[m->n + 1] = NULL;
+	if (m->n == 1) {
+		/* A single match is the substitution itself */
+		v[0] = v[1];
+		v[1] = NULL;
+	} else {
+		size_t i, len = strlen(v[1]);
+		for (i = 2; i <= m->n && len; i++) {
+			size_t j = 0;
+			while (j < len && v[i][j] == v[1][j])
+				j++;
+			len = j;
+		}
+		v[0] = (char*) malloc(len+1);
+		if (!v[0]) {
+			matches_free(m);
+			return NULL;
+		}
+		memcpy(v[0], v[1], len);
+		v[0][len] = '\0';
+	}
+	matches_init(m);
+	return v;
+}
+
+/**
+ * Finishes a vector of matches like matches_finish, but with a given substitution for the first slot
+ * instead of the common prefix, unless there's a single match
+ */
+static char** matches_finishas(matches_t *m, const char *subst)
+{
+	if (m->n < 2)
+		return matches_finish(m);
+	char **v = m->v;
+	v[m->n + 1] = NULL;
+	v[0] = (char*) malloc(strlen(subst) + 1);
+	if (!v[0]) {
+		matches_free(m);
+		return NULL;
+	}
+	strcpy(v[0], subst);
+	matches_init(m);
+	return v;
+}
+
+/**
+ * Adds the strings of an index starting with the prefix to a vector of matches, stopping at its limit
+ */
+static int matches_addindex(matches_t *m, const index_t *idx, const char *pref)
+{
+	size_t len = strlen(pref), i;
+	for (i = index_lowerbound(idx, pref); i < idx->count; i++) {
+		const char *str = index_get(idx, i);
+		if (strncmp(str, pref, len) != 0 || !matches_room(m))
+			break;
+		if (!matches_add(m, str, strlen(str)))
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Adds the string values of a Lua array to a vector of matches
+ * If a prefix is given, only the strings starting with it are added
+ * Stops at the limit of the vector
+ */
+static int matches_addtable(lua_State *L, matches_t *m, int tbl, const char *pref)
+{
+	size_t n = lua_rawlen(L, tbl), plen = pref ? strlen(pref) : 0, i;
+	lua_checkstack(L, 1);
+	for (i = 1; i <= n; i++, m->scanned++) {
+		lua_rawgeti(L, tbl, i);
+		if (lua_type(L, -1) == LUA_TSTRING || lua_type(L, -1) == LUA_TNUMBER) {
+			size_t len;
+			const char *str = lua_tolstring(L, -1, &len);
+			if (!pref || (len >= plen && strncmp(str, pref, plen) == 0)) {
+				if (!matches_room(m)) {
+					lua_pop(L, 1);
+					return 1;
+				}
+				if (!matches_add(m, str, len)) {
+					lua_pop(L, 1);
+					return 0;
+				}
+			}
+		}
+		lua_pop(L, 1);
+	}
+	return 1;
+}
+
+/**
+ * Drops the cached matches, releasing the generator they came from through the given Lua thread
+ */
+static void cache_clear(lua_State *L, context_t *ctx)
+{
+	free(ctx->cache.prefix);
+	ctx->cache.prefix = NULL;
+	free(ctx->cache.before);
+	ctx->cache.before = NULL;
+	index_free(&ctx->cache.idx);
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->cachesource);
+	ctx->cachesource = LUA_NOREF;
+}
+
+/**
+ * Checks if the cached matches came from the current generator
+ */
+static int cache_samesource(context_t *ctx)
+{
+	lua_State *L = ctx->L;
+	lua_checkstack(L, 2);
+	getref(L, ctx->cachesource);
+	getref(L, ctx->source);
+	int res = !lua_isnil(L, -1) && lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return res;
+}
+
+/**
+ * Checks if the part of the line before the word being completed is the one the cached matches were produced for
+ */
+static int cache_samebefore(context_t *ctx)
+{
+	size_t len = strlen(ctx->cache.before);
+	return rl_line_buffer && (size_t) ctx->wordstart == len && strncmp(rl_line_buffer, ctx->cache.before, len) == 0;
+}
+
+/**
+ * Checks if the text can be completed from the cache: the cached matches came from the current generator
+ * for the same part of the line before the word, and the text extends the cached prefix
+ */
+static int cache_hit(context_t *ctx, const char *text)
+{
+	return ctx->cache.prefix &&
+	       strncmp(text, ctx->cache.prefix, strlen(ctx->cache.prefix)) == 0 &&
+	       cache_samebefore(ctx) &&
+	       cache_samesource(ctx);
+}
+
+/**
+ * Stores the matches for the text produced by the current generator to the cache
+ */
+static void cache_store(context_t *ctx, const char *text, const matches_t *m)
+{
+	cache_clear(ctx->L, ctx);
+	ctx->cache.prefix = clonestr(text);
+	size_t before = rl_line_buffer && ctx->wordstart <= rl_end ? (size_t) ctx->wordstart : 0;
+	ctx->cache.before = (char*) malloc(before + 1);
+	if (ctx->cache.before) {
+		memcpy(ctx->cache.before, rl_line_buffer, before);
+		ctx->cache.before[before] = '\0';
+	}
+	if (!ctx->cache.prefix || !ctx->cache.before || !index_fromvector(&ctx->cache.idx, m->v ? m->v + 1 : NULL, m->n)) {
+		cache_clear(ctx->L, ctx);
+		return;
+	}
+	ctx->cache.filenames = rl_filename_completion_desired;
+	lua_checkstack(ctx->L, 1);
+	getref(ctx->L, ctx->source);
+	setref(ctx->L, &ctx->cachesource);
+}
+
+/**
+ * Adds the cached matches starting with the text to a vector of matches
+ * libreadline resets rl_filename_completion_desired for every completion, it's set again if the generator has set it
+ * Returns zero if memory allocation failed
+ */
+static int cache_matches(context_t *ctx, const char *text, matches_t *m)
+{
+	if (ctx->cache.filenames)
+		rl_filename_completion_desired = 1;
+	return matches_addindex(m, &ctx->cache.idx, text);
+}
+
+/**
+ * Adds the strings of an index starting with the prefix to a vector of matches on the prefetch worker
+ * Checks every now and then if the lookup has been cancelled by a newer request
+ * Returns zero if memory allocation failed or the lookup has been cancelled
+ */
+static int prefetch_lookup(prefetch_t *p, const index_t *idx, const char *pref, unsigned long gen, matches_t *m)
+{
+	size_t len = strlen(pref), i, n = 0;
+	for (i = index_lowerbound(idx, pref); i < idx->count; i++, n++) {
+		const char *str = index_get(idx, i);
+		if (strncmp(str, pref, len) != 0)
+			break;
+		if (m->limit && m->n >= m->limit) {
+			m->truncated = TRUNCATED_LIMIT;
+			break;
+		}
+		if (!matches_add(m, str, strlen(str)))
+			return 0;
+		if (n % 256 == 255) {
+			pthread_mutex_lock(&p->lock);
+			int cancelled = p->gen != gen || p->quit;
+			pthread_mutex_unlock(&p->lock);
+			if (cancelled)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * The prefetch worker thread: looks the requested prefixes up until told to quit
+ */
+static void* prefetch_worker(void *arg)
+{
+	prefetch_t *p = (prefetch_t*) arg;
+	pthread_mutex_lock(&p->lock);
+	while (!p->quit) {
+		if (!p->want || p->done == p->gen) {
+			pthread_cond_wait(&p->cond, &p->lock);
+			continue;
+		}
+		unsigned long gen = p->gen;
+		char *pref = clonestr(p->want);
+		const index_t *idx = p->idx;
+		matches_t m;
+		matches_init(&m);
+		m.limit = p->limit;
+		p->busy = 1;
+		pthread_mutex_unlock(&p->lock);
+		int ok = pref && prefetch_lookup(p, idx, pref, gen, &m);
+		pthread_mutex_lock(&p->lock);
+		p->busy = 0;
+		p->done = gen;
+		if (ok && gen == p->gen) {
+			matches_free(&p->result);
+			p->result = m;
+			free(p->have);
+			p->have = pref;
+		} else {
+			matches_free(&m);
+			free(pref);
+		}
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/**
+ * Cancels the lookup in progress and drops the prefetched matches
+ * Waits for the worker to let the index go, so that it can be released
+ */
+static void prefetch_reset(prefetch_t *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->gen++;
+	free(p->want);
+	p->want = NULL;
+	free(p->have);
+	p->have = NULL;
+	matches_free(&p->result);
+	while (p->busy)
+		pthread_cond_wait(&p->cond, &p->lock);
+	p->done = p->gen;
+	pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * Stops the prefetch worker and frees the prefetch state
+ */
+static void prefetch_free(prefetch_t *p)
+{
+	if (p->started) {
+		pthread_mutex_lock(&p->lock);
+		p->quit = 1;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+		pthread_join(p->thread, NULL);
+		p->started = 0;
+	}
+	prefetch_reset(p);
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+}
+
+/**
+ * Asks the worker to look a prefix up, cancelling the lookup of another prefix
+ */
+static void prefetch_request(prefetch_t *p, const char *pref, size_t len)
+{
+	if (p->want && strlen(p->want) == len && memcmp(p->want, pref, len) == 0)
+		return;
+	char *want = (char*) malloc(len + 1);
+	if (!want)
+		return;
+	memcpy(want, pref, len);
+	want[len] = '\0';
+	pthread_mutex_lock(&p->lock);
+	free(p->want);
+	p->want = want;
+	p->gen++;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * Gets the matches of a prefix from the prefetch, waiting for the lookup if that's the prefix requested
+ * The matches of a shorter prefix are filtered. Returns zero if there are no usable matches prefetched
+ */
+static int prefetch_take(prefetch_t *p, const char *text, matches_t *m)
+{
+	size_t len = strlen(text), i;
+	int ok = 0;
+	pthread_mutex_lock(&p->lock);
+	if (p->want && strcmp(p->want, text) == 0)
+		while (p->done != p->gen)
+			pthread_cond_wait(&p->cond, &p->lock);
+	if (p->have && strlen(p->have) == len && strcmp(p->have, text) == 0) {
+		/* The very prefix, hand the matches over and let the worker look it up again if needed */
+		*m = p->result;
+		matches_init(&p->result);
+		free(p->have);
+		p->have = NULL;
+		free(p->want);
+		p->want = NULL;
+		ok = 1;
+	} else if (p->have && !p->result.truncated && strncmp(p->have, text, strlen(p->have)) == 0) {
+		/* Matches cut short at the limit are missing some of the longer prefix */
+		ok = 1;
+		for (i = 1; i <= p->result.n && ok; i++)
+			if (strncmp(p->result.v[i], text, len) == 0)
+				ok = matches_add(m, p->result.v[i], strlen(p->result.v[i]));
+		if (!ok)
+			matches_free(m);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return ok;
+}
+
+/**
+ * Collects the matches of a prefix when prefetching, looking them up right away if they aren't prefetched
+ * The limit and the deadline of the vector are kept. Returns zero if memory allocation failed
+ */
+static int prefetch_matches(context_t *ctx, const char *text, matches_t *m)
+{
+	size_t limit = m->limit;
+	uint64_t deadline = m->deadline;
+	int ok = prefetch_take(&ctx->prefetch, text, m);
+	/* The prefetched matches replace the vector, and a failure resets it */
+	m->limit = limit;
+	m->deadline = deadline;
+	if (ok) {
+		matches_cap(m);
+		return 1;
+	}
+	return matches_addindex(m, ctx->prefetch.idx, text);
+}
+
+/**
+ * Forgets the line coloured by readline.highlight, at the start of a new one
+ */
+static void highlight_reset(highlight_t *h)
+{
+	int i;
+	for (i = 1; i <= h->nstyles; i++)
+		free(h->styles[i]);
+	h->nstyles = 0;
+	h->len = h->bad = 0;
+	if (h->cols)
+		h->cols[0] = 0;
+	h->valid = 0;
+}
+
+/**
+ * Frees the memory of the highlighting state
+ */
+static void highlight_free(highlight_t *h)
+{
+	highlight_reset(h);
+	free(h->line);
+	free(h->style);
+	free(h->cols);
+	h->line = NULL;
+	h->style = NULL;
+	h->cols = NULL;
+	h->cap = 0;
+}
+
+/**
+ * Makes room in the highlighting state for a line of len bytes
+ * Returns zero if memory allocation failed
+ */
+static int highlight_reserve(highlight_t *h, size_t len)
+{
+	if (len < h->cap)
+		return 1;
+	size_t cap = h->cap ? h->cap : 128;
+	while (cap <= len)
+		cap *= 2;
+	char *line = (char*) realloc(h->line, cap);
+	if (line)
+		h->line = line;
+	unsigned char *style = (unsigned char*) realloc(h->style, cap);
+	if (style)
+		h->style = style;
+	uint32_t *cols = (uint32_t*) realloc(h->cols, cap * sizeof(uint32_t));
+	if (cols)
+		h->cols = cols;
+	if (!line || !style || !cols)
+		return 0;
+	h->cap = cap;
+	return 1;
+}
+
+/**
+ * Returns the style of an escape sequence, adding it to the styles of the line, or 0 if there's no room for it
+ */
+static unsigned char highlight_style(highlight_t *h, const char *esc, size_t len)
+{
+	int i;
+	if (!len)
+		return 0;
+	for (i = 1; i <= h->nstyles; i++)
+		if (strlen(h->styles[i]) == len && memcmp(h->styles[i], esc, len) == 0)
+			return (unsigned char) i;
+	if (h->nstyles == HIGHLIGHT_STYLES)
+		return 0;
+	char *s = (char*) malloc(len + 1);
+	if (!s)
+		return 0;
+	memcpy(s, esc, len);
+	s[len] = '\0';
+	h->styles[++h->nstyles] = s;
+	return (unsigned char) h->nstyles;
+}
+
+/**
+ * Computes the display columns of the bytes of the line from the given one on, the columns before it being known
+ * Multibyte characters are assumed to be UTF-8, so that the computation can start in the middle of the line
+ */
+static void highlight_columns(highlight_t *h, size_t from)
+{
+	mbstate_t ps;
+	memset(&ps, 0, sizeof(ps));
+	while (from > 0 && from < h->len && MB_CUR_MAX > 1 && ((unsigned char) h->line[from] & 0xC0) == 0x80)
+		from--;
+	if (h->bad >= from)
+		h->bad = h->len;
+	size_t i = from, k;
+	uint32_t col = from ? h->cols[from] : 0;
+	while (i < h->len) {
+		unsigned char c = (unsigned char) h->line[i];
+		if (c < 0x80) {
+			/* libreadline shows control characters as ^X */
+			if ((c < 0x20 || c == 0x7f) && h->bad > i)
+				h->bad = i;
+			h->cols[i++] = col++;
+			continue;
+		}
+		wchar_t wc;
+		size_t n = MB_CUR_MAX > 1 ? mbrtowc(&wc, h->line + i, h->len - i, &ps) : 1;
+		int w = 1;
+		if (MB_CUR_MAX > 1 && (n == (size_t) -1 || n == (size_t) -2 || n == 0 || (w = wcwidth(wc)) < 0)) {
+			if (h->bad > i)
+				h->bad = i;
+			memset(&ps, 0, sizeof(ps));
+			n = w = 1;
+		}
+		for (k = 0; k < n; k++)
+			h->cols[i + k] = col;
+		col += (uint32_t) w;
+		i += n;
+	}
+	h->cols[h->len] = col;
+}
+
+/**
+ * Returns the display width of the last line of a prompt, skipping the invisible parts marked by libreadline
+ */
+static size_t highlight_promptwidth(const char *prompt)
+{
+	const char *nl = strrchr(prompt, '\n');
+	const char *p = nl ? nl + 1 : prompt;
+	mbstate_t ps;
+	memset(&ps, 0, sizeof(ps));
+	size_t width = 0;
+	int hidden = 0;
+	while (*p) {
+		if (*p == RL_PROMPT_START_IGNORE || *p == RL_PROMPT_END_IGNORE) {
+			hidden = *p++ == RL_PROMPT_START_IGNORE;
+			continue;
+		}
+		wchar_t wc;
+		size_t n = MB_CUR_MAX > 1 ? mbrtowc(&wc, p, strlen(p), &ps) : 1;
+		int w = 1;
+		if (MB_CUR_MAX > 1 && (n == (size_t) -1 || n == (size_t) -2 || n == 0 || (w = wcwidth(wc)) < 0)) {
+			memset(&ps, 0, sizeof(ps));
+			n = w = 1;
+		}
+		if (!hidden)
+			width += (size_t) w;
+		p += n;
+	}
+	return width;
+}
+
+/**
+ * Moves the cursor between two cells of the input area, counted from the start of the row the prompt ends on
+ * The row the cursor is on is given, as it's not the one of the cell it's at while the terminal waits to wrap
+ */
+static void highlight_move(FILE *out, size_t row, size_t to, size_t width)
+{
+	size_t torow = to / width;
+	if (torow < row)
+		fprintf(out, "\033[%luA", (unsigned long) (row - torow));
+	else if (torow > row)
+		fprintf(out, "\033[%luB", (unsigned long) (torow - row));
+	fputc('\r', out);
+	if (to % width)
+		fprintf(out, "\033[%luC", (unsigned long) (to % width));
+}
+
+/**
+ * Calls the function of readline.highlight for the changed part of the line and applies the styles it returns
+ * to the bytes from the position it tells on. Widens the range of the bytes to display again from first up to stop
+ * by the ones whose style has changed. Returns -1 if the function has raised an error
+ */
+static int highlight_call(context_t *ctx, size_t changed, size_t end, size_t *first, size_t *stop)
+{
+	highlight_t *h = &ctx->highlight;
+	lua_State *L = ctx->L;
+	lua_checkstack(L, 6);
+	int top = lua_gettop(L);
+	getref(L, h->fn);
+	lua_pushlstring(L, h->line, h->len);
+	lua_pushnumber(L, (lua_Number) (changed + 1));
+	lua_pushnumber(L, (lua_Number) end);
+	if (lua_pcall(L, 3, 2, 0)) {
+		ctx_fail(ctx);
+		return -1;
+	}
+	size_t pos = lua_isnumber(L, top + 1) && lua_tonumber(L, top + 1) >= 1 ? (size_t) lua_tonumber(L, top + 1) - 1 : 0;
+	if (lua_istable(L, top + 2)) {
+		size_t n = lua_rawlen(L, top + 2), i;
+		for (i = 1; i + 1 <= n && pos < h->len; i += 2) {
+			size_t esclen = 0;
+			lua_rawgeti(L, top + 2, (int) i);
+			lua_rawgeti(L, top + 2, (int) i + 1);
+			const char *esc = lua_tolstring(L, -2, &esclen);
+			lua_Number cnt = lua_tonumber(L, -1);
+			unsigned char style = esc ? highlight_style(h, esc, esclen) : 0;
+			size_t to = cnt <= 0 ? pos : cnt < (lua_Number) (h->len - pos) ? pos + (size_t) cnt : h->len;
+			for (; pos < to; pos++)
+				if (h->style[pos] != style) {
+					h->style[pos] = style;
+					if (*first > pos)
+						*first = pos;
+					if (*stop <= pos)
+						*stop = pos + 1;
+				}
+			lua_pop(L, 2);
+		}
+	}
+	lua_settop(L, top);
+	return 0;
+}
+
+/**
+ * rl_redisplay_function used with readline.highlight: lets libreadline redisplay the line,
+ * then writes the part of it that has changed or been restyled again in the styles the function has given.
+ * The bytes before the first change and after the last one keep their styles, so the function only needs
+ * to go over the changed part. The line is left as libreadline has displayed it when it can't be coloured
+ * in place: while libreadline shows another prompt (a search or an argument), the region or a control character,
+ * or scrolls the line horizontally
+ */
+static void highlight_redisplay(void)
+{
+	context_t *ctx = globalCtx;
+	rl_redisplay();
+	if (!ctx || ctx->highlight.fn == LUA_NOREF || ctx->failed)
+		return;
+	highlight_t *h = &ctx->highlight;
+	size_t n = (size_t) rl_end, oldlen = h->len, d = 0, s = 0;
+	if (!highlight_reserve(h, n > oldlen ? n : oldlen))
+		return;
+	/* These commands have libreadline draw the line again from scratch */
+	if (rl_last_func == rl_clear_screen || rl_last_func == rl_refresh_line || rl_last_func == rl_complete
+		|| rl_last_func == rl_possible_completions || rl_last_func == rl_insert_completions
+		|| rl_last_func == rl_menu_complete || rl_last_func == rl_backward_menu_complete
+		|| rl_last_func == rl_old_menu_complete)
+		h->valid = 0;
+	/* The changed bytes: the line has the first d and the last s bytes of the old one */
+	while (d < n && d < oldlen && h->line[d] == rl_line_buffer[d])
+		d++;
+	while (s < n - d && s < oldlen - d && h->line[oldlen - 1 - s] == rl_line_buffer[n - 1 - s])
+		s++;
+	/* The bytes to display again, from first up to stop */
+	size_t first = n, stop = 0;
+	if (d < n || d < oldlen) {
+		memmove(h->style + n - s, h->style + oldlen - s, s);
+		memset(h->style + d, 0, n - s - d);
+		memcpy(h->line + d, rl_line_buffer + d, n - d);
+		h->len = n;
+		highlight_columns(h, d);
+		first = d;
+		/* libreadline redraws the rest of the line if the change has moved it */
+		stop = n != oldlen ? n : n - s;
+		if (highlight_call(ctx, d, n - s, &first, &stop) < 0)
+			return;
+	}
+	int rows, width;
+	rl_get_screen_size(&rows, &width);
+	/* libreadline scrolls the line horizontally when told to or when the terminal can't move the cursor up */
+	const char *hscroll = rl_variable_value("horizontal-scroll-mode"), *up = rl_get_termcap("up");
+	if (rl_display_prompt != rl_prompt || h->bad < h->len || (hscroll && strcmp(hscroll, "on") == 0) || !up || !*up || width <= 0
+#if RL_READLINE_VERSION >= 0x0801
+		|| rl_mark_active_p()
+#endif
+		) {
+		h->valid = 0;
+		return;
+	}
+	if (!h->valid) {
+		first = 0;
+		stop = n;
+	}
+	h->valid = 1;
+	/* Multibyte characters are written as a whole */
+	while (first > 0 && first < n && MB_CUR_MAX > 1 && ((unsigned char) h->line[first] & 0xC0) == 0x80)
+		first--;
+	if (first >= stop)
+		return;
+	FILE *out = rl_outstream ? rl_outstream : stdout;
+	size_t prompt = highlight_promptwidth(rl_display_prompt), i, cur = prompt + h->cols[rl_point];
+	highlight_move(out, cur / (size_t) width, prompt + h->cols[first], (size_t) width);
+	unsigned char style = 0;
+	for (i = first; i < stop; i++) {
+		int charstart = MB_CUR_MAX == 1 || ((unsigned char) h->line[i] & 0xC0) != 0x80;
+		if (h->style[i] != style && charstart) {
+			fputs("\033[0m", out);
+			style = h->style[i];
+			if (style)
+				fputs(h->styles[style], out);
+		}
+		fputc(h->line[i], out);
+	}
+	fputs("\033[0m", out);
+	/* Past the end of a row the terminal waits for the next character to wrap */
+	size_t end = prompt + h->cols[stop];
+	highlight_move(out, end % (size_t) width == 0 && end ? end / (size_t) width - 1 : end / (size_t) width, cur, (size_t) width);
+	fflush(out);
+}
+
+/**
+ * Initialises libreadline if it hasn't been, as the first readline() call would, so that it doesn't override
+ * what is set up for the call. That's done with the default redisplay function, as libreadline takes
+ * the terminal for a dumb one if it's initialised with a custom one
+ */
+static void readline_initialize(void)
+{
+	if (!RL_ISSTATE(RL_STATE_INITIALIZED)) {
+		rl_voidfunc_t *fn = rl_redisplay_function;
+		rl_redisplay_function = rl_redisplay;
+		rl_initialize();
+		rl_redisplay_function = fn;
+	}
+}
+
+/**
+ * Installs an rl_redisplay_function, initialising libreadline first if it hasn't been
+ */
+static void redisplay_install(rl_voidfunc_t *fn)
+{
+	if (fn != rl_redisplay)
+		readline_initialize();
+	rl_redisplay_function = fn;
+}
+
+/**
+ * rl_redisplay_function used when prefetching: requests the lookup of the word before the cursor
+ * every time the line has been redisplayed, which is after every change of it
+ */
+static void prefetch_redisplay(void)
+{
+	context_t *ctx = globalCtx;
+	highlight_redisplay();
+	if (!ctx || !ctx->prefetching)
+		return;
+	const char *breaks = rl_completer_word_break_characters ? rl_completer_word_break_characters : rl_basic_word_break_characters;
+	int start = rl_point;
+	while (start > 0 && !strchr(breaks, rl_line_buffer[start - 1]))
+		start--;
+	/* Every string of the index would match an empty word, that's left to a completion asking for it */
+	if (start < rl_point)
+		prefetch_request(&ctx->prefetch, rl_line_buffer + start, (size_t) (rl_point - start));
+}
+
+/**
+ * Sets up the prefetch from the index at the given stack index, the lookups stopping at the limit of the completion,
+ * starting the worker if it's not running. Returns zero if the worker couldn't be started
+ */
+static int prefetch_setup(lua_State *L, context_t *ctx, int idx, size_t limit)
+{
+	prefetch_t *p = &ctx->prefetch;
+	const index_t *index = (const index_t*) lua_touserdata(L, idx);
+	if (index != p->idx || limit != p->limit) {
+		/* The matches prefetched under another limit are dropped too */
+		prefetch_reset(p);
+		pthread_mutex_lock(&p->lock);
+		p->limit = limit;
+		p->idx = index;
+		pthread_mutex_unlock(&p->lock);
+		lua_pushvalue(L, idx);
+		setref(L, &ctx->prefetchindex);
+	}
+	if (!p->started) {
+		if (pthread_create(&p->thread, NULL, prefetch_worker, p))
+			return 0;
+		p->started = 1;
+	}
+	return 1;
+}
+
+/* The number of matches the completion stops at when the limit option is true and libreadline never asks before listing */
+#define COMPLETION_LIMIT 100
+
+/**
+ * Returns the number of matches a completion stops collecting at, 0 if unlimited
+ */
+static size_t completion_limit(context_t *ctx)
+{
+	if (!ctx->limitquery)
+		return ctx->limit;
+	/* One less than the number libreadline asks before listing at, so a truncated list is shown right away */
+	return rl_completion_query_items > 1 ? (size_t) rl_completion_query_items - 1 : COMPLETION_LIMIT;
+}
+
+/**
+ * Returns the time a completion starting now has to stop collecting matches at, 0 if it has no time budget
+ */
+static uint64_t completion_deadline(context_t *ctx)
+{
+	return ctx->timeout ? clock_ms() + ctx->timeout : 0;
+}
+
+/**
+ * Returns the next match for gen_function, the first one if state is zero
+ */
+static char* gen_next(context_t *ctx, const char* text, int state)
+{
+	if (!state)
+		ctx->truncated = TRUNCATED_NONE;
+	if (ctx->caching || ctx->prefetching) {
+		if (!state) {
+			/* Collect all the matches in advance, from the prefetch or the cache if possible */
+			matches_free(&ctx->pending);
+			ctx->pending.limit = completion_limit(ctx);
+			ctx->pending.deadline = completion_deadline(ctx);
+			ctx->pendingpos = 0;
+			if (ctx->prefetching)
+				prefetch_matches(ctx, text, &ctx->pending);
+			else if (cache_hit(ctx, text))
+				cache_matches(ctx, text, &ctx->pending);
+			else if (lua_initgenerator(ctx, text)) {
+				char *str;
+				while (!matches_expired(&ctx->pending) && (str = lua_stepgenerator(ctx))) {
+					int ok = matches_room(&ctx->pending) && matches_add(&ctx->pending, str, strlen(str));
+					free(str);
+					if (!ok)
+						break;
+				}
+				/* A truncated set of matches can't serve longer prefixes */
+				if (!ctx->failed && !ctx->pending.truncated)
+					cache_store(ctx, text, &ctx->pending);
+			}
+			ctx->truncated = ctx->pending.truncated;
+		}
+		/* Hand the collected matches over to libreadline */
+		if (ctx->pendingpos < ctx->pending.n) {
+			char *str = ctx->pending.v[++ctx->pendingpos];
+			ctx->pending.v[ctx->pendingpos] = NULL;
+			return str;
+		}
+		matches_free(&ctx->pending);
+		return NULL;
+	}
+	/* If completion iterator wasn't started, initialize it */
+	if (!state) {
+		ctx->deadline = completion_deadline(ctx);
+		if (!lua_initgenerator(ctx, text))
+			return NULL;
+		ctx->handed = 0;
+	}
+	if (completion_interrupted())
+		return NULL;
+	if (ctx->deadline && clock_ms() >= ctx->deadline) {
+		/* Out of time, offer what has been handed out so far */
+		ctx->truncated = TRUNCATED_TIMEOUT;
+		return NULL;
+	}
+	/* Call the completion iterator */
+	char *str = lua_stepgenerator(ctx);
+	size_t limit = completion_limit(ctx);
+	if (str && limit && ctx->handed++ >= limit) {
+		/* Over the limit, leave the rest of the iterator alone */
+		free(str);
+		ctx->truncated = TRUNCATED_LIMIT;
+		return NULL;
+	}
+	return str;
+}
+
+/* Wrapper to provide a generator function for libreadline */
+static char* gen_function(const char* text, int state)
+{
+	context_t *ctx = globalCtx;
+	char *str = gen_next(ctx, text, state);
+	if (ctx->stats.enabled) {
+		if (!state)
+			ctx->stats.completions++;
+		if (str)
+			ctx->stats.matchbytes += strlen(str) + 1;
+	}
+	return str;
+}
+
+/**
+ * Adds the strings returned by an iterator on top of the stack to a vector of matches
+ * Stops calling the iterator once a string over the limit of the vector has been returned
+ * or the deadline of the vector has passed. Returns zero if memory allocation failed or the iterator has raised an error
+ */
+static int matches_additerator(context_t *ctx, matches_t *m)
+{
+	lua_State *L = ctx->L;
+	for (;;) {
+		if (matches_expired(m))
+			return 1;
+		lua_pushvalue(L, -1);
+		if (gen_pcall(ctx, 0, 0)) {
+			ctx_fail(ctx);
+			return 0;
+		}
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			return 1;
+		}
+		size_t len;
+		const char *str = lua_tolstring(L, -1, &len);
+		if (str && !matches_room(m)) {
+			lua_pop(L, 1);
+			return 1;
+		}
+		int ok = str && matches_add(m, str, len);
+		lua_pop(L, 1);
+		if (!ok)
+			return 0;
+	}
+}
+
+/* The number of the best fuzzy matches returned when the fuzzy option is true */
+#define FUZZY_LIMIT 100
+/* The number of candidates prefiltered by their character masks at a time */
+#define FUZZY_CHUNK 4096
+/* Fuzzy match scoring, after fzf: every matched character scores, gaps cost, and matches at word
+ * boundaries, camel case humps and runs of consecutive matches get a bonus */
+#define FUZZY_MATCH 16
+#define FUZZY_GAPSTART (-3)
+#define FUZZY_GAPEXT (-1)
+#define FUZZY_BOUNDARY 8
+#define FUZZY_CAMEL 7
+#define FUZZY_CONSECUTIVE 4
+#define FUZZY_FIRST 2
+
+/* Character classes for the fuzzy match bonuses */
+enum { FUZZY_SEP, FUZZY_LOWER, FUZZY_UPPER, FUZZY_DIGIT };
+
+/**
+ * A candidate ranked by the fuzzy matcher, pos is its position in the source of the candidates
+ */
+typedef struct _fuzzyhit_t {
+	int score;
+	size_t len;
+	size_t pos;
+} fuzzyhit_t;
+
+/**
+ * The state of a fuzzy match: the pattern and the best k candidates seen so far,
+ * kept in a heap with the worst of them on top
+ */
+typedef struct _fuzzy_t {
+	const char *pat;
+	size_t plen;
+	uint64_t mask;
+	/* Whether the matching ignores case, which it does unless the pattern has upper case letters */
+	int fold;
+	fuzzyhit_t *heap;
+	size_t n;
+	size_t k;
+	/* The number of the candidates matched, including the ones not kept */
+	size_t hits;
+	/* The deadline of the completion, see matches_t, and whether it has been hit */
+	uint64_t deadline;
+	int expired;
+} fuzzy_t;
+
+/**
+ * Returns the bit of a character in a character mask, letters of both cases share a bit
+ */
+static int fuzzy_charbit(unsigned char c)
+{
+	if (c >= 'a' && c <= 'z')
+		return c - 'a';
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= '0' && c <= '9')
+		return 26 + c - '0';
+	return 36 + c % 28;
+}
+
+/**
+ * Returns the mask of the characters a string consists of
+ * A string can only match a pattern if its mask has all the bits of the mask of the pattern
+ */
+static uint64_t fuzzy_mask(const char *str, size_t len)
+{
+	uint64_t mask = 0;
+	size_t i;
+	for (i = 0; i < len; i++)
+		mask |= (uint64_t) 1 << fuzzy_charbit((unsigned char) str[i]);
+	return mask;
+}
+
+/**
+ * Returns the character masks of the strings of an index, computing them on the first call
+ * Returns NULL if memory allocation failed
+ */
+static const uint64_t* index_fuzzymasks(index_t *idx)
+{
+	size_t i;
+	if (idx->masks)
+		return idx->masks;
+	idx->masks = (uint64_t*) malloc(idx->count * sizeof(uint64_t));
+	if (!idx->masks)
+		return NULL;
+	for (i = 0; i < idx->count; i++) {
+		const char *str = index_get(idx, i);
+		idx->masks[i] = fuzzy_mask(str, strlen(str));
+	}
+	return idx->masks;
+}
+
+/**
+ * Returns the character class of a character for the match bonuses
+ */
+static int fuzzy_class(unsigned char c)
+{
+	if (c >= 'a' && c <= 'z')
+		return FUZZY_LOWER;
+	if (c >= 'A' && c <= 'Z')
+		return FUZZY_UPPER;
+	if (c >= '0' && c <= '9')
+		return FUZZY_DIGIT;
+	return c >= 0x80 ? FUZZY_LOWER : FUZZY_SEP;
+}
+
+/**
+ * Returns the bonus for matching a character of a class following a character of another class
+ */
+static int fuzzy_bonus(int prev, int cls)
+{
+	if (cls == FUZZY_SEP)
+		return FUZZY_BOUNDARY;
+	if (prev == FUZZY_SEP)
+		return FUZZY_BOUNDARY;
+	if ((prev == FUZZY_LOWER && cls == FUZZY_UPPER) || (prev != FUZZY_DIGIT && cls == FUZZY_DIGIT))
+		return FUZZY_CAMEL;
+	return 0;
+}
+
+/**
+ * Compares a character of a candidate with a character of the pattern
+ */
+static int fuzzy_eq(const fuzzy_t *f, unsigned char c, unsigned char p)
+{
+	if (f->fold && c >= 'A' && c <= 'Z')
+		c += 'a' - 'A';
+	return c == p;
+}
+
+/**
+ * Scores a candidate against the pattern the way fzf v1 does: the first occurrence of the pattern
+ * as a subsequence is found scanning forward, then shortened scanning backward from its end
+ * Returns 0 if the candidate doesn't match, the score is stored to *score otherwise
+ */
+static int fuzzy_score(const fuzzy_t *f, const char *str, size_t len, int *score)
+{
+	size_t i, j = 0, start = 0, end;
+	for (i = 0; i < len && j < f->plen; i++)
+		if (fuzzy_eq(f, (unsigned char) str[i], (unsigned char) f->pat[j]))
+			if (!j++)
+				start = i;
+	if (j < f->plen)
+		return 0;
+	end = i;
+	for (i = end; j && i > start; i--)
+		if (fuzzy_eq(f, (unsigned char) str[i-1], (unsigned char) f->pat[j-1]))
+			if (!--j)
+				start = i - 1;
+	/* A run of consecutive matches keeps the bonus of its first character */
+	int total = 0, gap = 0, consecutive = 0, runbonus = 0;
+	int prev = start ? fuzzy_class((unsigned char) str[start-1]) : FUZZY_SEP;
+	for (i = start, j = 0; i < end; i++) {
+		int cls = fuzzy_class((unsigned char) str[i]);
+		if (j < f->plen && fuzzy_eq(f, (unsigned char) str[i], (unsigned char) f->pat[j])) {
+			int bonus = fuzzy_bonus(prev, cls);
+			if (consecutive) {
+				if (bonus >= FUZZY_BOUNDARY)
+					runbonus = bonus;
+				if (bonus < runbonus)
+					bonus = runbonus;
+				if (bonus < FUZZY_CONSECUTIVE)
+					bonus = FUZZY_CONSECUTIVE;
+			} else
+				runbonus = bonus;
+			total += FUZZY_MATCH + (j ? bonus : bonus * FUZZY_FIRST);
+			consecutive = 1;
+			gap = 0;
+			j++;
+		} else {
+			total += gap ? FUZZY_GAPEXT : FUZZY_GAPSTART;
+			consecutive = 0;
+			gap = 1;
+		}
+		prev = cls;
+	}
+	*score = total;
+	return 1;
+}
+
+/**
+ * Checks if a fuzzy hit ranks better than another: by the score, then by the length, then by the position
+ */
+static int fuzzy_better(const fuzzyhit_t *a, const fuzzyhit_t *b)
+{
+	if (a->score != b->score)
+		return a->score > b->score;
+	if (a->len != b->len)
+		return a->len < b->len;
+	return a->pos < b->pos;
+}
+
+/**
+ * qsort comparator ordering fuzzy hits from the best one
+ */
+static int cmpfuzzyhit(const void *a, const void *b)
+{
+	if (fuzzy_better((const fuzzyhit_t*) a, (const fuzzyhit_t*) b))
+		return -1;
+	return fuzzy_better((const fuzzyhit_t*) b, (const fuzzyhit_t*) a);
+}
+
+/**
+ * Starts a fuzzy match of a pattern keeping the best k candidates
+ * Returns zero if memory allocation failed
+ */
+static int fuzzy_init(fuzzy_t *f, const char *pat, size_t k)
+{
+	size_t i;
+	f->pat = pat;
+	f->plen = strlen(pat);
+	f->mask = fuzzy_mask(pat, f->plen);
+	f->fold = 1;
+	for (i = 0; i < f->plen; i++)
+		if (pat[i] >= 'A' && pat[i] <= 'Z')
+			f->fold = 0;
+	f->n = 0;
+	f->k = k;
+	f->hits = 0;
+	f->deadline = 0;
+	f->expired = 0;
+	f->heap = (fuzzyhit_t*) malloc(k * sizeof(fuzzyhit_t));
+	return f->heap != NULL;
+}
+
+/**
+ * Scores a candidate and keeps it if it ranks among the best k
+ */
+static void fuzzy_consider(fuzzy_t *f, const char *str, size_t len, size_t pos)
+{
+	fuzzyhit_t hit;
+	size_t i, c;
+	if (!fuzzy_score(f, str, len, &hit.score))
+		return;
+	f->hits++;
+	hit.len = len;
+	hit.pos = pos;
+	if (f->n < f->k) {
+		/* Sift the new hit up */
+		for (i = f->n++; i > 0 && fuzzy_better(&f->heap[(i-1)/2], &hit); i = (i-1)/2)
+			f->heap[i] = f->heap[(i-1)/2];
+		f->heap[i] = hit;
+		return;
+	}
+	if (!fuzzy_better(&hit, &f->heap[0]))
+		return;
+	/* Replace the worst hit and sift the new one down */
+	for (i = 0; (c = 2*i + 1) < f->n; i = c) {
+		if (c + 1 < f->n && fuzzy_better(&f->heap[c], &f->heap[c+1]))
+			c++;
+		if (!fuzzy_better(&hit, &f->heap[c]))
+			break;
+		f->heap[i] = f->heap[c];
+	}
+	f->heap[i] = hit;
+}
+
+/**
+ * Sets a bit in the bitmap for every one of the n masks having all the bits of the mask of the pattern, bit i % 64
+ * of word i / 64 for the mask i. The masks are tested 4 at a time with AVX2, 2 at a time with SSE2 or NEON,
+ * and one at a time by the scalar loop doing the rest
+ */
+static void fuzzy_prefilter(uint64_t pattern, const uint64_t *masks, size_t n, uint64_t *bits)
+{
+	size_t i = 0;
+	memset(bits, 0, (n + 63) / 64 * sizeof(uint64_t));
+#if defined(__AVX2__)
+	const __m256i p = _mm256_set1_epi64x((long long) pattern), zero = _mm256_setzero_si256();
+	for (; i + 4 <= n; i += 4) {
+		__m256i missing = _mm256_andnot_si256(_mm256_loadu_si256((const __m256i*) (masks + i)), p);
+		uint64_t hit = (uint64_t) _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(missing, zero)));
+		bits[i / 64] |= hit << (i % 64);
+	}
+#elif defined(__SSE2__)
+	const __m128i p = _mm_set1_epi64x((long long) pattern), zero = _mm_setzero_si128();
+	for (; i + 2 <= n; i += 2) {
+		__m128i missing = _mm_andnot_si128(_mm_loadu_si128((const __m128i*) (masks + i)), p);
+		/* There's no 64-bit comparison in SSE2: a lane is zero if all of its 8 bytes are */
+		int zeros = _mm_movemask_epi8(_mm_cmpeq_epi8(missing, zero));
+		uint64_t hit = (uint64_t) ((zeros & 0xff) == 0xff) | (uint64_t) (((zeros >> 8) & 0xff) == 0xff) << 1;
+		bits[i / 64] |= hit << (i % 64);
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	const uint64x2_t p = vdupq_n_u64(pattern);
+	for (; i + 2 <= n; i += 2) {
+		uint64x2_t match = vceqzq_u64(vbicq_u64(p, vld1q_u64(masks + i)));
+		uint64_t hit = (vgetq_lane_u64(match, 0) & 1) | (vgetq_lane_u64(match, 1) & 1) << 1;
+		bits[i / 64] |= hit << (i % 64);
+	}
+#endif
+	for (; i < n; i++)
+		bits[i / 64] |= (uint64_t) !(pattern & ~masks[i]) << (i % 64);
+}
+
+/**
+ * Returns the position of the lowest bit set in a nonzero word
+ */
+static int fuzzy_lowbit(uint64_t w)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(w);
+#else
+	int n = 0;
+	while (!(w & 1)) {
+		w >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+/**
+ * Runs a fuzzy match over the strings of an index, prefiltering them by their character masks
+ * with fuzzy_prefilter into a bitmap, and scoring only the strings whose bits are set
+ * Stops at the deadline, checked every FUZZY_CHUNK strings
+ * Returns zero if memory allocation failed
+ */
+static int fuzzy_matchindex(fuzzy_t *f, index_t *idx)
+{
+	uint64_t bits[FUZZY_CHUNK / 64];
+	size_t base, i;
+	if (!idx->count)
+		return 1;
+	const uint64_t *masks = index_fuzzymasks(idx);
+	if (!masks)
+		return 0;
+	for (base = 0; base < idx->count; base += FUZZY_CHUNK) {
+		if (completion_interrupted())
+			break;
+		if (f->deadline && clock_ms() >= f->deadline) {
+			f->expired = 1;
+			break;
+		}
+		size_t end = base + FUZZY_CHUNK < idx->count ? base + FUZZY_CHUNK : idx->count;
+		fuzzy_prefilter(f->mask, masks + base, end - base, bits);
+		for (i = 0; i < (end - base + 63) / 64; i++) {
+			uint64_t w;
+			for (w = bits[i]; w; w &= w - 1) {
+				size_t pos = base + i * 64 + (size_t) fuzzy_lowbit(w);
+				const char *str = index_get(idx, pos);
+				fuzzy_consider(f, str, strlen(str), pos);
+			}
+		}
+	}
+	return 1;
+}
+
+/**
+ * Fuzzy generator function, used instead of lua_batchgenerator when the fuzzy option is set
+ * Matches the text as a subsequence against the candidates of a table or an index generator,
+ * or against the candidates a function generator returns, and collects the best ones ordered by rank
+ */
+static char** lua_fuzzygenerator(context_t *ctx, const char *text)
+{
+	lua_State *L = ctx->L;
+	matches_t m, all;
+	fuzzy_t f;
+	index_t *idx = NULL;
+	int ok = 1, tbl = 0;
+	size_t i;
+	if (!fuzzy_init(&f, text, ctx->fuzzy))
+		return NULL;
+	matches_init(&m);
+	matches_init(&all);
+	f.deadline = all.deadline = completion_deadline(ctx);
+	lua_checkstack(L, 3);
+	getref(L, ctx->generator);
+	if (lua_isfunction(L, -1)) {
+		if (gen_pcall(ctx, pushgenargs(ctx, text), 1)) {
+			ctx_fail(ctx);
+			free(f.heap);
+			return NULL;
+		}
+		if (lua_isfunction(L, -1))
+			/* An iterator, collect the candidates to rank them */
+			ok = matches_additerator(ctx, &all);
+	}
+	if (lua_istable(L, -1))
+		tbl = lua_gettop(L);
+	else
+		idx = (index_t*) testudata(L, -1, INDEX_METATABLE);
+	if (!ok)
+		;
+	else if (idx)
+		ok = fuzzy_matchindex(&f, idx);
+	else if (tbl) {
+		size_t n = lua_rawlen(L, tbl), len;
+		if (ctx->stats.enabled)
+			ctx->stats.scanned += n;
+		for (i = 1; i <= n; i++) {
+			lua_rawgeti(L, tbl, i);
+			if (lua_type(L, -1) == LUA_TSTRING || lua_type(L, -1) == LUA_TNUMBER) {
+				const char *str = lua_tolstring(L, -1, &len);
+				fuzzy_consider(&f, str, len, i);
+			}
+			lua_pop(L, 1);
+		}
+		if (ctx->stats.enabled)
+			ctx->stats.matched += f.hits;
+	} else
+		for (i = 1; i <= all.n; i++)
+			fuzzy_consider(&f, all.v[i], strlen(all.v[i]), i);
+	/* Collect the hits from the best one */
+	qsort(f.heap, f.n, sizeof(fuzzyhit_t), cmpfuzzyhit);
+	for (i = 0; i < f.n && ok; i++) {
+		size_t pos = f.heap[i].pos;
+		if (idx)
+			ok = matches_add(&m, index_get(idx, pos), f.heap[i].len);
+		else if (tbl) {
+			lua_rawgeti(L, tbl, (int) pos);
+			ok = matches_add(&m, lua_tostring(L, -1), f.heap[i].len);
+			lua_pop(L, 1);
+		} else
+			ok = matches_add(&m, all.v[pos], f.heap[i].len);
+	}
+	lua_pop(L, 1);
+	matches_free(&all);
+	if (f.expired || all.truncated)
+		ctx->truncated = TRUNCATED_TIMEOUT;
+	else if (f.hits > f.n)
+		ctx->truncated = TRUNCATED_LIMIT;
+	free(f.heap);
+	if (!ok) {
+		matches_free(&m);
+		return NULL;
+	}
+	/* The matches don't share a prefix with the text, so the text is kept as is unless there's a single match */
+	return matches_finishas(&m, text);
+}
+
+/**
+ * Drops the index a paged completion would go on from
+ */
+static void page_clear(lua_State *L, context_t *ctx)
+{
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->pageindex);
+	ctx->pageindex = LUA_NOREF;
+	free(ctx->pageprefix);
+	ctx->pageprefix = NULL;
+}
+
+/**
+ * Returns the number of matches making a page of the paged display, at least two so that a page cut short
+ * isn't taken for the only match
+ */
+static size_t page_lines(void)
+{
+	int rows = 0, cols = 0;
+	rl_get_screen_size(&rows, &cols);
+	return rows > 3 ? (size_t) rows - 1 : 2;
+}
+
+/**
+ * Adds the strings of the index at the given stack index starting with the prefix to a vector of matches,
+ * like matches_addindex. With the paged display they stop at a page unless there's a limit, and if they're cut short
+ * by the page, the index is kept for paged_display to take the rest from. A limit given by the user caps the listing
+ * as well, so it's never continued past
+ */
+static int matches_addpaged(context_t *ctx, matches_t *m, int ud, const char *pref)
+{
+	lua_State *L = ctx->L;
+	index_t *idx = (index_t*) lua_touserdata(L, ud);
+	if (!ctx->paging || m->limit)
+		return matches_addindex(m, idx, pref);
+	m->limit = page_lines();
+	if (!matches_addindex(m, idx, pref))
+		return 0;
+	if (m->truncated != TRUNCATED_LIMIT)
+		return 1;
+	char *prefix = strdup(pref);
+	if (!prefix)
+		return 0;
+	size_t len = strlen(pref), lo, hi;
+	ctx->pageprefix = prefix;
+	ctx->pagenext = index_lowerbound(idx, pref) + m->n;
+	/* The matches are contiguous, find where they end */
+	for (lo = ctx->pagenext, hi = idx->count; lo < hi; ) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (strncmp(index_get(idx, mid), pref, len) == 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	ctx->pageend = lo;
+	/* The common prefix of sorted strings is the one of the first and the last */
+	const char *first = m->v[1], *last = index_get(idx, lo - 1);
+	for (ctx->pagelcd = 0; first[ctx->pagelcd] && first[ctx->pagelcd] == last[ctx->pagelcd]; ctx->pagelcd++)
+		;
+	lua_pushvalue(L, ud);
+	setref(L, &ctx->pageindex);
+	return 1;
+}
+
+/**
+ * Batch generator function
+ * Collects all the matches for the text from the generator stored by lua_readline in one pass
+ * A table or an index generator is filtered in C without calling Lua at all.
+ * A function generator is called once and may return an array of matches, an index to be filtered
+ * or an iterator, which is drained the same way as in the per-item mode
+ */
+static char** lua_batchgenerator(context_t *ctx, const char *text)
+{
+	lua_State *L = ctx->L;
+	matches_t m;
+	int ok = 1;
+	ctx->truncated = TRUNCATED_NONE;
+	page_clear(L, ctx);
+	if (ctx->fuzzy)
+		return lua_fuzzygenerator(ctx, text);
+	matches_init(&m);
+	m.limit = completion_limit(ctx);
+	m.deadline = completion_deadline(ctx);
+	if (ctx->prefetching) {
+		if (!prefetch_matches(ctx, text, &m)) {
+			matches_free(&m);
+			return NULL;
+		}
+		ctx->truncated = m.truncated;
+		return matches_finish(&m);
+	}
+	if (ctx->caching && cache_hit(ctx, text)) {
+		/* The prefix refines a cached one, filter the cached matches */
+		if (!cache_matches(ctx, text, &m)) {
+			matches_free(&m);
+			return NULL;
+		}
+		ctx->truncated = m.truncated;
+		return matches_finish(&m);
+	}
+	lua_checkstack(L, 3);
+	getref(L, ctx->generator);
+	if (lua_isfunction(L, -1)) {
+		/* Call the generator function once and inspect its result */
+		if (gen_pcall(ctx, pushgenargs(ctx, text), 1)) {
+			ctx_fail(ctx);
+			return NULL;
+		}
+		if (lua_isfunction(L, -1))
+			/* An iterator, drain it */
+			ok = matches_additerator(ctx, &m);
+		else if (lua_istable(L, -1))
+			/* The function has already filtered the candidates */
+			ok = matches_addtable(L, &m, lua_gettop(L), NULL);
+		else if (testudata(L, -1, INDEX_METATABLE))
+			ok = matches_addpaged(ctx, &m, lua_gettop(L), text);
+	} else if (lua_istable(L, -1)) {
+		ok = matches_addtable(L, &m, lua_gettop(L), text);
+		if (ctx->stats.enabled) {
+			ctx->stats.scanned += m.scanned;
+			ctx->stats.matched += m.n;
+		}
+	} else if (testudata(L, -1, INDEX_METATABLE))
+		ok = matches_addpaged(ctx, &m, lua_gettop(L), text);
+	lua_pop(L, 1);
+	if (!ok) {
+		matches_free(&m);
+		return NULL;
+	}
+	ctx->truncated = m.truncated;
+	/* A truncated set of matches can't serve longer prefixes */
+	if (ctx->caching && !m.truncated)
+		cache_store(ctx, text, &m);
+	char **v = matches_finish(&m);
+	if (ctx->pageindex != LUA_NOREF) {
+		/* All the matches get listed, the page only cuts short what's collected up front */
+		ctx->truncated = TRUNCATED_NONE;
+		/* The matches of the page don't have to share more than all of them do */
+		if (v && strlen(v[0]) > ctx->pagelcd)
+			v[0][ctx->pagelcd] = '\0';
+	}
+	return v;
+}
+
+/* Wrapper to provide an attempted completion function for libreadline in batch mode */
+static char** batch_function(const char *text, int start, int end)
+{
+	/* Don't fall back to filename completion */
+	rl_attempted_completion_over = 1;
+	globalCtx->wordstart = start;
+	globalCtx->wordend = end;
+	char **v = lua_batchgenerator(globalCtx, text);
+	if (v && completion_interrupted()) {
+		/* The input is cancelled, don't complete from a partial set of matches */
+		size_t i;
+		for (i = 0; v[i]; i++)
+			free(v[i]);
+		free(v);
+		v = NULL;
+	}
+	stats_t *st = &globalCtx->stats;
+	if (st->enabled) {
+		size_t i;
+		st->completions++;
+		for (i = 0; v && v[i]; i++)
+			st->matchbytes += strlen(v[i]) + 1 + sizeof(char*);
+		if (v)
+			st->matchbytes += sizeof(char*);
+	}
+	return v;
+}
+
+/**
+ * Returns the part of a match libreadline would display, the last component of a file name
+ */
+static const char* page_printable(const char *match)
+{
+	if (!rl_filename_completion_desired)
+		return match;
+	size_t len = strlen(match);
+	/* A directory keeps its trailing slash */
+	const char *slash = len > 1 ? (const char*) memrchr(match, '/', len - 1) : NULL;
+	return slash ? slash + 1 : match;
+}
+
+/**
+ * Lists the matches of a completion a page at a time like libreadline's pager does, taking them from the index
+ * the completion has been cut short from once the ones collected run out. A page is only written out and,
+ * if the matches come from an index, collected from it when the user asks for it with the space or the 'y' key,
+ * the return key asking for a line. The matches go in rows, so that the width of the columns only has to fit
+ * the matches of the page
+ */
+static void paged_display(context_t *ctx, char **matches, int num, int max)
+{
+	FILE *out = rl_outstream ? rl_outstream : stdout;
+	int rows = 0, cols = 0;
+	rl_get_screen_size(&rows, &cols);
+	if (cols < 1)
+		cols = 80;
+	index_t *idx = NULL;
+	if (ctx->pageindex != LUA_NOREF) {
+		/* Kept alive by the reference */
+		getref(ctx->L, ctx->pageindex);
+		idx = (index_t*) testudata(ctx->L, -1, INDEX_METATABLE);
+		lua_pop(ctx->L, 1);
+	}
+	size_t lines = page_lines(), pagelines = lines, cap = lines * ((size_t) cols / 3 + 1), n = 0, i, j;
+	const char **page = (const char**) malloc(cap * sizeof(char*));
+	if (!page)
+		return;
+	size_t width = (size_t) max, next = 1;
+	rl_crlf();
+	for (;;) {
+		size_t percol = (size_t) cols / (width + 2) ? (size_t) cols / (width + 2) : 1, want = pagelines * percol;
+		/* Collect the page, narrowing it if a match takes wider columns */
+		while (n < want) {
+			const char *match = NULL;
+			if (next <= (size_t) num)
+				match = matches[next++];
+			else if (idx && ctx->pagenext < ctx->pageend && ctx->pagenext < idx->count &&
+				!strncmp(index_get(idx, ctx->pagenext), ctx->pageprefix, strlen(ctx->pageprefix)))
+				match = index_get(idx, ctx->pagenext++);
+			if (!match)
+				break;
+			page[n++] = page_printable(match);
+			size_t w = highlight_promptwidth(page[n-1]);
+			if (w > width) {
+				width = w;
+				percol = (size_t) cols / (width + 2) ? (size_t) cols / (width + 2) : 1;
+				want = pagelines * percol;
+			}
+		}
+		size_t shown = n < want ? n : want;
+		for (i = 0; i < shown; i += percol) {
+			for (j = i; j < i + percol && j < shown; j++) {
+				fputs(page[j], out);
+				if (j + 1 < i + percol && j + 1 < shown)
+					fprintf(out, "%*s", (int) (width + 2 - highlight_promptwidth(page[j])), "");
+			}
+			rl_crlf();
+		}
+		/* The matches over a narrowed page start the next one */
+		memmove(page, page + shown, (n - shown) * sizeof(char*));
+		n -= shown;
+		int more = n || next <= (size_t) num ||
+			(idx && ctx->pagenext < ctx->pageend && ctx->pagenext < idx->count);
+		if (!more)
+			break;
+		fputs("--More--", out);
+		fflush(out);
+		int c = rl_read_key();
+		fputs("\r        \r", out);
+		if (c == ' ' || c == 'y' || c == 'Y')
+			pagelines = lines;
+		else if (c == '\r' || c == '\n')
+			pagelines = 1;
+		else
+			break;
+	}
+	free(page);
+	rl_forced_update_display();
+}
+
+/**
+ * rl_completion_display_matches_hook installed by the display option: calls the Lua function given
+ * as display(matches, max) with the array of the matches and the length of the longest one,
+ * or lists the matches with paged_display
+ */
+static void display_matches(char **matches, int num, int max)
+{
+	context_t *ctx = globalCtx;
+	if (!ctx)
+		return;
+	if (ctx->display == LUA_NOREF) {
+		paged_display(ctx, matches, num, max);
+		return;
+	}
+	lua_State *L = ctx->L;
+	int i;
+	lua_checkstack(L, 4);
+	getref(L, ctx->display);
+	lua_createtable(L, num, 0);
+	for (i = 1; i <= num; i++) {
+		lua_pushstring(L, matches[i]);
+		lua_rawseti(L, -2, i);
+	}
+	lua_pushnumber(L, (lua_Number) max);
+	if (lua_pcall(L, 2, 0, 0)) {
+		ctx_fail(ctx);
+		return;
+	}
+	rl_forced_update_display();
+}
+
+/* Attempted completion function for the per-item mode: records the bounds of the word for the generator
+ * and lets libreadline go on with gen_function */
+static char** bounds_function(const char *text, int start, int end)
+{
+	(void) text;
+	globalCtx->wordstart = start;
+	globalCtx->wordend = end;
+	return NULL;
+}
+
+/**
+ * Returns the boolean value of an option in an options table, or zero if there is no options table
+ */
+static int getboolopt(lua_State *L, int opts, const char *name)
+{
+	if (!lua_istable(L, opts))
+		return 0;
+	lua_getfield(L, opts, name);
+	int res = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	return res;
+}
+
+/**
+ * A signal handler cancelling the readline() call in progress
+ * It only sets a flag, which readline_getc and the completion check, so nothing is unwound from under
+ * a running generator. libreadline passes the signal on here after cleaning up if it catches the signals itself.
+ * Outside of readline() calls it behaves like the handler it has replaced
+ */
+static void readline_sigint(int sig)
+{
+	if (globalArmed) {
+		if (!globalInterrupted) {
+			globalInterrupted = 1;
+			/* Interrupt the read the thread running readline() may be blocked in */
+			if (!pthread_equal(pthread_self(), globalReadingThread))
+				pthread_kill(globalReadingThread, sig);
+		}
+		return;
+	}
+	/* Step aside and let the replaced handler see the signal once we return */
+	sigaction(SIGINT, &globalOldSigint, NULL);
+	globalSigintInstalled = 0;
+	raise(sig);
+}
+
+/**
+ * Installs readline_sigint saving the old action, unless it is installed already
+ * The system calls aren't restarted, so that a blocking read returns to readline_getc
+ */
+static void sigint_install(void)
+{
+	if (!globalSigintInstalled) {
+		struct sigaction act;
+		memset(&act, 0, sizeof(act));
+		act.sa_handler = readline_sigint;
+		sigemptyset(&act.sa_mask);
+		sigaction(SIGINT, &act, &globalOldSigint);
+		globalSigintInstalled = 1;
+	}
+}
+
+/**
+ * Restores the action replaced by sigint_install
+ */
+static void sigint_restore(void)
+{
+	if (globalSigintInstalled) {
+		sigaction(SIGINT, &globalOldSigint, NULL);
+		globalSigintInstalled = 0;
+	}
+}
+
+/**
+ * Calls the handler of a SIGINT action, unless it's the default or ignores the signal
+ */
+static void sigint_call(const struct sigaction *act)
+{
+	if (act->sa_flags & SA_SIGINFO) {
+		siginfo_t info;
+		memset(&info, 0, sizeof(info));
+		info.si_signo = SIGINT;
+		act->sa_sigaction(SIGINT, &info, NULL);
+	} else if (act->sa_handler != SIG_DFL && act->sa_handler != SIG_IGN)
+		act->sa_handler(SIGINT);
+}
+
+/**
+ * rl_getc_function used by readline_interactive: reads a character like rl_getc does,
+ * but returns to libreadline when the input is cancelled by SIGINT
+ * An EOF on an empty line makes readline() return NULL, so the line is dropped first
+ */
+static int readline_getc(FILE *stream)
+{
+	unsigned char c;
+	histlog_navigated();
+	for (;;) {
+#if RL_READLINE_VERSION >= 0x0801
+		/* A signal such as SIGWINCH may have libreadline draw the line again from scratch */
+		if (rl_pending_signal() && globalCtx)
+			globalCtx->highlight.valid = 0;
+		/* Let libreadline deal with a signal it has caught, it passes SIGINT on to readline_sigint */
+		rl_check_signals();
+#endif
+		if (globalInterrupted) {
+			rl_free_line_state();
+			rl_point = rl_end = rl_mark = 0;
+			rl_line_buffer[0] = '\0';
+			return EOF;
+		}
+		if (globalDraining)
+			return EOF;
+		if (stream == globalPendingStream && globalPendingPos < globalPendingLen)
+			return (unsigned char) globalPendingInput[globalPendingPos++];
+		ssize_t n = read(fileno(stream), &c, 1);
+		if (n == 1)
+			return c;
+		if (n == 0 || errno != EINTR)
+			return EOF;
+#if RL_READLINE_VERSION >= 0x0700 && RL_READLINE_VERSION < 0x0801
+		/* Without rl_check_signals, libreadline only handles a signal it has caught after the key is returned,
+		 * passing SIGINT on to the handler then, so the input is cancelled right away here */
+		if (rl_pending_signal() == SIGINT && globalArmed)
+			globalInterrupted = 1;
+#endif
+		if (rl_signal_event_hook)
+			(*rl_signal_event_hook)();
+	}
+}
+
+#if RL_READLINE_VERSION >= 0x0700
+/**
+ * Reads the text pasted in the bracketed paste mode up to PASTE_END, PASTE_CHUNK bytes at a time
+ * rather than a key at a time. The keys libreadline has read ahead come first, taken with rl_read_key,
+ * then the input left over by the last paste. The bytes read past PASTE_END are left for readline_getc
+ * Returns the text in a buffer to be freed, one byte longer than the length stored to len, or NULL
+ * if out of memory or the input is cancelled. The text read so far is returned if the input ends
+ */
+static char* paste_read(FILE *stream, size_t *len)
+{
+	const size_t marker = sizeof(PASTE_END) - 1;
+	size_t n = 0, from = 0, cap = PASTE_CHUNK, left;
+	char *buf = (char*) malloc(cap + 1);
+	if (!buf)
+		return NULL;
+	/* libreadline's buffer of the keys read ahead is much shorter than a chunk. rl_read_key would wait
+	 * for the event hook rather than call readline_getc once it's empty */
+	rl_hook_func_t *hook = rl_event_hook;
+	int c;
+	rl_event_hook = NULL;
+	globalDraining = 1;
+	while (n < cap && (c = rl_read_key()) != EOF)
+		buf[n++] = (char) c;
+	globalDraining = 0;
+	rl_event_hook = hook;
+	/* Then the input left over by the last paste */
+	if (stream == globalPendingStream && globalPendingPos < globalPendingLen) {
+		left = globalPendingLen - globalPendingPos;
+		if (n + left > cap) {
+			cap = n + left;
+			char *nbuf = (char*) realloc(buf, cap + 1);
+			if (!nbuf) {
+				free(buf);
+				return NULL;
+			}
+			buf = nbuf;
+		}
+		memcpy(buf + n, globalPendingInput + globalPendingPos, left);
+		n += left;
+		globalPendingPos = globalPendingLen;
+	}
+	for (;;) {
+		char *end = (char*) memmem(buf + from, n - from, PASTE_END, marker);
+		if (end) {
+			*len = (size_t) (end - buf);
+			size_t rest = n - *len - marker;
+			if (rest) {
+				char *pending = (char*) realloc(globalPendingInput, rest);
+				/* The keys typed after the paste are dropped if there's no room for them */
+				if (pending) {
+					memcpy(pending, end + marker, rest);
+					globalPendingInput = pending;
+					globalPendingStream = stream;
+					globalPendingLen = rest;
+					globalPendingPos = 0;
+				}
+			}
+			return buf;
+		}
+		/* PASTE_END may be split between the reads */
+		from = n >= marker ? n - marker + 1 : 0;
+		if (cap - n < PASTE_CHUNK) {
+			char *nbuf = (char*) realloc(buf, cap * 2 + 1);
+			if (!nbuf) {
+				free(buf);
+				return NULL;
+			}
+			buf = nbuf;
+			cap *= 2;
+		}
+#if RL_READLINE_VERSION >= 0x0801
+		rl_check_signals();
+#endif
+		if (globalInterrupted) {
+			free(buf);
+			return NULL;
+		}
+		ssize_t k = read(fileno(stream), buf + n, cap - n);
+		if (k > 0)
+			n += (size_t) k;
+		else if (k == 0 || errno != EINTR) {
+			*len = n;
+			return buf;
+		}
+	}
+}
+
+/**
+ * The command bound to PASTE_START by paste_install: takes the pasted text in bulk and inserts it into the line
+ * at once, so that the line is only redisplayed after the whole of it. The carriage returns terminals send
+ * for the newlines are made newlines. With the PASTE_ACCEPT mode the line is accepted if the text ends with a newline,
+ * readline() returning the lines pasted as one string
+ */
+static int paste_begin(int count, int key)
+{
+	context_t *ctx = globalCtx;
+	if (!ctx || !ctx->paste || rl_getc_function != readline_getc)
+		return rl_bracketed_paste_begin(count, key);
+	size_t len, i, j;
+	char *text = paste_read(rl_instream ? rl_instream : stdin, &len);
+	if (!text)
+		return 1;
+	for (i = j = 0; i < len; i++) {
+		if (text[i] == '\r') {
+			text[j++] = '\n';
+			if (i + 1 < len && text[i+1] == '\n')
+				i++;
+		} else
+			text[j++] = text[i];
+	}
+	int accept = ctx->paste == PASTE_ACCEPT && j && text[j-1] == '\n';
+	if (accept)
+		j--;
+	text[j] = '\0';
+	if (j)
+		rl_insert_text(text);
+	free(text);
+	if (accept)
+		return rl_newline(1, '\n');
+	return 0;
+}
+
+/**
+ * Turns the bracketed paste mode on for a readline() call and binds PASTE_START to paste_begin
+ * in the emacs and vi insertion keymaps, saving what it replaces to the context
+ */
+static void paste_install(context_t *ctx)
+{
+	static const char *const maps[2] = {"emacs", "vi-insert"};
+	int i;
+	/* libreadline binds PASTE_START when it's initialised, which would then be restored over */
+	readline_initialize();
+	const char *on = rl_variable_value("enable-bracketed-paste");
+	ctx->pastewason = on && !strcmp(on, "on");
+	rl_variable_bind("enable-bracketed-paste", "on");
+	for (i = 0; i < 2; i++) {
+		Keymap map = rl_get_keymap_by_name(maps[i]);
+		int type = ISFUNC;
+		rl_command_func_t *fn = map ? rl_function_of_keyseq(PASTE_START, map, &type) : NULL;
+		/* A macro or a prefix of longer sequences is left alone */
+		ctx->pastebound[i] = map && type == ISFUNC;
+		if (ctx->pastebound[i]) {
+			ctx->pastesaved[i] = fn;
+			rl_bind_keyseq_in_map(PASTE_START, paste_begin, map);
+		}
+	}
+}
+
+/**
+ * Restores what paste_install has replaced
+ */
+static void paste_remove(context_t *ctx)
+{
+	static const char *const maps[2] = {"emacs", "vi-insert"};
+	int i;
+	for (i = 0; i < 2; i++) {
+		if (ctx->pastebound[i])
+			rl_bind_keyseq_in_map(PASTE_START, ctx->pastesaved[i], rl_get_keymap_by_name(maps[i]));
+		ctx->pastebound[i] = 0;
+	}
+	if (!ctx->pastewason)
+		rl_variable_bind("enable-bracketed-paste", "off");
+}
+#endif
+
+/**
+ * Returns the stream libreadline reads the input from for a context
+ * That's the input of the session the context works with, if any
+ */
+static FILE* instream(context_t *ctx)
+{
+	if (ctx->session)
+		return ctx->session->in;
+	FILE *fd = globalSession ? globalDefaultIn : rl_instream;
+	return fd ? fd : stdin;
+}
+
+/**
+ * Returns the stream libreadline writes the output to for a context, like instream
+ */
+static FILE* outstream(context_t *ctx)
+{
+	if (ctx->session)
+		return ctx->session->out;
+	FILE *fd = globalSession ? globalDefaultOut : rl_outstream;
+	return fd ? fd : stdout;
+}
+
+/**
+ * Checks if a line should be read bypassing libreadline
+ * The "fast" option forces the choice, otherwise the fast path is used when the input is not a terminal
+ */
+static int usefastpath(lua_State *L, context_t *ctx, int opts)
+{
+	if (lua_istable(L, opts)) {
+		lua_getfield(L, opts, "fast");
+		int type = lua_type(L, -1), res = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		if (type != LUA_TNIL)
+			return res;
+	}
+	FILE *fd = instream(ctx);
+	if (fd != ctx->ttystream) {
+		ctx->ttystream = fd;
+		ctx->ttyresult = isatty(fileno(fd));
+	}
+	return !ctx->ttyresult;
+}
+
+/**
+ * Reads a line from the input stream without libreadline and pushes it without the trailing newline
+ * The prompt is written to the output stream first as libreadline would, without the markers of its invisible parts.
+ * The input is read through stdio, which buffers ahead of the line, while libreadline reads the descriptor itself.
+ * So the input read with the fast path once is to be read with it from then on, the buffered input being lost
+ * to libreadline otherwise
+ * Returns 0 on EOF, like lua_readline does
+ */
+static int readline_fast(lua_State *L, context_t *ctx, const char *prompt)
+{
+	if (prompt && *prompt) {
+		FILE *out = outstream(ctx);
+		for (; *prompt; prompt++)
+			if (*prompt != RL_PROMPT_START_IGNORE && *prompt != RL_PROMPT_END_IGNORE)
+				putc(*prompt, out);
+		fflush(out);
+	}
+	ssize_t len = getline(&ctx->linebuf, &ctx->linecap, instream(ctx));
+	if (len < 0)
+		return 0;
+	if (len && ctx->linebuf[len-1] == '\n')
+		len--;
+	lua_pushlstring(L, ctx->linebuf, (size_t) len);
+	return 1;
+}
+
+/**
+ * Sets up completion for a readline call
+ * Stores the generator at the given stack index to the context according to the options table
+ * at the given stack index and points libreadline to the generator wrappers.
+ * See lua_readline for the generator types and the options
+ */
+static void lua_setgenerator(lua_State *L, context_t *ctx, int gen, int opts)
+{
+	int type = lua_type(L, gen);
+	int batch = getboolopt(L, opts, "batch");
+	ctx->caching = getboolopt(L, opts, "cache");
+	ctx->fuzzy = 0;
+	ctx->paging = 0;
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->display);
+	ctx->display = LUA_NOREF;
+	if (lua_istable(L, opts)) {
+		lua_getfield(L, opts, "display");
+		if (lua_isfunction(L, -1))
+			setref(L, &ctx->display);
+		else {
+			ctx->paging = lua_type(L, -1) == LUA_TSTRING && !strcmp(lua_tostring(L, -1), "paged");
+			lua_pop(L, 1);
+		}
+	}
+	if (ctx->display != LUA_NOREF || ctx->paging)
+		rl_completion_display_matches_hook = display_matches;
+	else if (rl_completion_display_matches_hook == display_matches)
+		rl_completion_display_matches_hook = NULL;
+	/* The paged display takes the rest of a page cut short from the index in a pass of the batch mode */
+	if (ctx->paging)
+		batch = 1;
+	if (lua_istable(L, opts)) {
+		lua_getfield(L, opts, "fuzzy");
+		if (lua_type(L, -1) == LUA_TNUMBER)
+			ctx->fuzzy = lua_tonumber(L, -1) >= 1 ? (size_t) lua_tonumber(L, -1) : 1;
+		else if (lua_toboolean(L, -1))
+			ctx->fuzzy = FUZZY_LIMIT;
+		lua_pop(L, 1);
+	}
+	ctx->limit = 0;
+	ctx->limitquery = 0;
+	ctx->timeout = 0;
+	ctx->paste = PASTE_OFF;
+	if (lua_istable(L, opts)) {
+		lua_getfield(L, opts, "paste");
+		if (lua_type(L, -1) == LUA_TSTRING && !strcmp(lua_tostring(L, -1), "accept"))
+			ctx->paste = PASTE_ACCEPT;
+		else if (lua_toboolean(L, -1))
+			ctx->paste = PASTE_INSERT;
+		lua_pop(L, 1);
+		lua_getfield(L, opts, "complete_timeout_ms");
+		if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) > 0)
+			/* Round a fraction of a millisecond up rather than down to no budget */
+			ctx->timeout = (uint64_t) lua_tonumber(L, -1) + (lua_tonumber(L, -1) < 1);
+		lua_pop(L, 1);
+		lua_getfield(L, opts, "limit");
+		if (lua_type(L, -1) == LUA_TNUMBER)
+			ctx->limit = lua_tonumber(L, -1) >= 1 ? (size_t) lua_tonumber(L, -1) : 1;
+		else
+			ctx->limitquery = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	/* Fuzzy matches are ranked and don't share a prefix, which only the batch mode can hand over */
+	if (ctx->fuzzy) {
+		batch = 1;
+		ctx->caching = 0;
+	}
+	rl_sort_completion_matches = !ctx->fuzzy;
+	lua_checkstack(L, 2);
+	if (ctx->caching) {
+		/* Remember the generator as given for the cache to check it */
+		lua_pushvalue(L, gen);
+		setref(L, &ctx->source);
+		if (ctx->cache.prefix && !cache_samesource(ctx))
+			cache_clear(L, ctx);
+	}
+	/* Check what type of generator we have */
+	if (batch)
+		/* In batch mode the generator is stored as is, lua_batchgenerator inspects it */
+		lua_pushvalue(L, gen);
+	else switch(type) {
+		case LUA_TFUNCTION:
+			/* The generator is a Lua function, use it as is */
+			lua_pushvalue(L, gen);
+			break;
+		case LUA_TTABLE:
+			/* The generator is a Lua table, create an iterator with ipairs */
+			lua_pushvalue(L, gen);
+			lua_pushcclosure(L, lua_ipairsiterator, 1);
+			break;
+		case LUA_TUSERDATA:
+			/* The generator is an index, look the prefix up in it */
+			if (testudata(L, gen, INDEX_METATABLE)) {
+				lua_pushvalue(L, gen);
+				lua_pushcclosure(L, lua_indexgenerator, 1);
+				break;
+			}
+			/* Fall through */
+		default:
+			/* We have no generator, use an "empty" iterator instead of it */
+			lua_pushcfunction(L, lua_niliterator);
+	}
+	/* Store Lua generator function to the context */
+	setref(L, &ctx->generator);
+	/* Prefetch the matches from an index if asked to */
+	ctx->prefetching = !ctx->fuzzy && getboolopt(L, opts, "prefetch") && testudata(L, gen, INDEX_METATABLE) &&
+		prefetch_setup(L, ctx, gen, completion_limit(ctx));
+	if (ctx->prefetching)
+		redisplay_install(prefetch_redisplay);
+	else if (ctx->highlight.fn != LUA_NOREF)
+		redisplay_install(highlight_redisplay);
+	else if (rl_redisplay_function == prefetch_redisplay || rl_redisplay_function == highlight_redisplay)
+		rl_redisplay_function = rl_redisplay;
+	/* A new line is about to be displayed */
+	highlight_reset(&ctx->highlight);
+	/* Point libreadlint to our generator wrapper */
+	rl_completion_entry_function = gen_function;
+	rl_attempted_completion_function = batch ? batch_function : bounds_function;
+	/* Set the Lua thread for the generator function to be called on */
+	ctx->L = L;
+	globalSerial++;
+}
+
+/**
+ * Calls readline() with SIGINT trapped to cancel the input, expects the completion to be set up
+ * and libreadline to be acquired with ctx_enter
+ * If keep is nonzero, the signal handler is left installed for the next call
+ * Pushes the line read and returns 1, or returns 0 on EOF or cancel
+ */
+static int readline_interactive(lua_State *L, context_t *ctx, const char *prompt, int keep)
+{
+	/* Trap SIGINT to cancel libreadline input, saving the old handler */
+	sigint_install();
+	globalReadingThread = pthread_self();
+	globalInterrupted = 0;
+	rl_getc_func_t *getc = rl_getc_function;
+	rl_getc_function = readline_getc;
+	if (ctx->stats.enabled)
+		ctx->stats.readstart = clock_ns();
+#if RL_READLINE_VERSION >= 0x0700
+	if (ctx->paste)
+		paste_install(ctx);
+#endif
+#if RL_READLINE_VERSION < 0x0700
+	/* There's no telling SIGINT caught by libreadline is pending, so readline_sigint gets it instead */
+	int catching = rl_catch_signals;
+	rl_catch_signals = 0;
+#endif
+	globalArmed = 1;
+	char *line = readline(prompt);
+	globalArmed = 0;
+	hist_edited();
+#if RL_READLINE_VERSION < 0x0700
+	rl_catch_signals = catching;
+#endif
+	ctx->cancelled = globalInterrupted;
+	rl_getc_function = getc;
+#if RL_READLINE_VERSION >= 0x0700
+	if (ctx->paste)
+		paste_remove(ctx);
+#endif
+	if (ctx->stats.enabled) {
+		ctx->stats.reads++;
+		ctx->stats.readns += clock_ns() - ctx->stats.readstart;
+	}
+	if (globalInterrupted) {
+		globalInterrupted = 0;
+		free(line);
+		if (ctx->stats.enabled)
+			ctx->stats.cancels++;
+		/* Restore the old signal handler and call it, if it doesn't terminate the process return nil */
+		struct sigaction old = globalOldSigint;
+		sigint_restore();
+		sigint_call(&old);
+		return 0;
+	}
+	/* Restore signals on return */
+	if (!keep)
+		sigint_restore();
+	if (ctx->failed) {
+		/* A generator has raised an error, the caller rethrows it */
+		free(line);
+		return 0;
+	}
+	if (!line) {
+		/* If NULL was returned, check for EOF on input */
+		if (feof(instream(ctx)))
+			/* If input is EOF, return nil */
+			return 0;
+	}
+	/* Return the string read by readline() */
+	lua_pushstring(L, line);
+	/* Free the string returned by readline() */
+	free(line);
+	return 1;
+}
+
+/**
+ * Wrapper function for the readline function
+ * Args:
+ * 1) Prompt - a string to display before the user input area
+ * 2) Generator - a Lua function that returns an iterator of completions, a table of possible completions, an index built by readline.index
+ *    or readline.files to complete file names
+ * 3) Options - an optional table of options:
+ *    batch - if true, collect all the completions in one pass through rl_attempted_completion_function.
+ *            A function generator is then called once per completion and may return an array of matches instead of an iterator
+ *    cache - if true, keep the matches of the last completion and serve completions of longer prefixes
+ *            by filtering them instead of calling the generator again. The generator must only return
+ *            matches starting with the prefix for this to be correct. The cache is dropped when
+ *            a different generator is passed or readline.clearcache() is called
+ *    fuzzy - if true or a number K, match the text as a subsequence of the candidates instead of a prefix
+ *            and offer the best K matches (100 if true) ranked the way fzf does. The matching ignores case
+ *            unless the text has upper case letters. Implies batch, and for a function generator
+ *            the candidates it returns are matched rather than trusted to match
+ *    limit - if a number K, stop collecting the matches after K of them, so that completing a short prefix
+ *            doesn't make the generator produce every candidate: an iterator isn't called any more and
+ *            a table or an index isn't scanned any further. If true, K is one less than
+ *            rl_completion_query_items, so the truncated list is shown without asking.
+ *            readline.truncated() tells whether the last completion has been cut short
+ *    complete_timeout_ms - the time budget of a completion in milliseconds. Once it's used up,
+ *                          the iterator isn't called any more and the matches collected so far are offered,
+ *                          readline.truncated() then returning true, "timeout". A single call of the generator
+ *                          isn't interrupted, so it should return an iterator for the budget to be kept
+ *    prefetch - if true and the generator is an index, look the word before the cursor up in the index
+ *               on a background thread as the line is edited, so that the matches are mostly ready
+ *               when completion is requested. A lookup is cancelled when the word changes
+ *    display - a function to list the matches instead of libreadline, called as display(matches, max)
+ *              with the array of the matches and the length of the longest one, or "paged" to list them
+ *              a page at a time, the space key showing the next page, return the next line and any other key
+ *              stopping. Implies batch, and the matches of an index are then only collected for the first page
+ *              unless there's a limit, the others being taken from the index as they're listed, so that
+ *              a prefix with a huge number of matches costs a page of them
+ *    paste - if true, turn the bracketed paste mode on and take pasted text in bulk: it's read in large blocks
+ *            and inserted into the line at once, which is only redisplayed after it, newlines included.
+ *            If "accept", a paste ending with a newline also accepts the line, so that readline returns
+ *            the pasted lines as one string rather than a line per call
+ *    fast - if true, read the line straight from the input stream bypassing libreadline:
+ *           the prompt is written out, but there's no editing, completion or signal handling.
+ *           Defaults to true if the input is not a terminal. The input is buffered ahead of the line,
+ *           so once it has been read with the fast path it shouldn't be read without it
+ * The generator function gets called with the prefix of a word that has been already entered, the whole line,
+ * the positions of the first and the last character of the word in the line (line:sub(start, end) is the word)
+ * and the number of characters before the cursor (line:sub(1, point) is the text before it), so that it can
+ * choose the candidates by what precedes the word. The prefix cache only serves lines with the same text before the word.
+ * An error raised by the generator ends the input and is raised again by this function.
+ * Note: this function is not reenterable as it sets libreadline global variables and system signal handlers.
+ * Calls from different Lua states are serialised
+ */
+static int lua_readline(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	const char *prompt = lua_tolstring(L, 1, NULL);
+	if (usefastpath(L, ctx, 3))
+		return readline_fast(L, ctx, prompt);
+	ctx_enter(L, ctx);
+	if (globalCallbackCtx || globalInstalledSessions) {
+		ctx_leave(ctx);
+		return luaL_error(L, "A callback handler is installed");
+	}
+	lua_setgenerator(L, ctx, 2, 3);
+	int res = readline_interactive(L, ctx, prompt, 0);
+	ctx_leave(ctx);
+	ctx_rethrow(L, ctx);
+	return res;
+}
+
+/**
+ * The iterator function returned by readline.lines
+ * Upvalues:
+ * 1) The context
+ * 2-4) The prompt, the generator and the options passed to readline.lines
+ * 5) The value of globalSerial when the completion was set up by this iterator
+ * 6) Whether the fast path is used
+ */
+static int lua_linesstep(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	if (lua_toboolean(L, lua_upvalueindex(6)))
+		return readline_fast(L, ctx, lua_tostring(L, lua_upvalueindex(2)));
+	ctx_enter(L, ctx);
+	if (globalCallbackCtx || globalInstalledSessions) {
+		ctx_leave(ctx);
+		return luaL_error(L, "A callback handler is installed");
+	}
+	/* Only set the completion up again if someone else has changed it */
+	if (lua_tonumber(L, lua_upvalueindex(5)) != (lua_Number) globalSerial) {
+		lua_setgenerator(L, ctx, lua_upvalueindex(3), lua_upvalueindex(4));
+		lua_pushnumber(L, (lua_Number) globalSerial);
+		lua_replace(L, lua_upvalueindex(5));
+	} else
+		ctx->L = L;
+	int res = readline_interactive(L, ctx, lua_tostring(L, lua_upvalueindex(2)), 1);
+	if (!res)
+		/* The loop is over */
+		sigint_restore();
+	ctx_leave(ctx);
+	ctx_rethrow(L, ctx);
+	return res;
+}
+
+/**
+ * readline.lines(prompt, gen, opts) - returns an iterator reading lines until EOF or cancel
+ * for line in readline.lines(prompt, gen, opts) do ... end
+ * Works like calling readline.readline(prompt, gen, opts) repeatedly, but the completion setup and
+ * the SIGINT handler are kept across the iterations. If the loop is left early, SIGINT is still
+ * delivered to the original handler
+ */
+static int lua_lines(lua_State *L)
+{
+	lua_settop(L, 3);
+	lua_checkstack(L, 5);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	lua_pushnumber(L, -1);
+	lua_pushboolean(L, usefastpath(L, getcontext(L), 4));
+	lua_pushcclosure(L, lua_linesstep, 6);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, -2);
+	lua_pushcclosure(L, lua_guarded, 2);
+	return 1;
+}
+
+/**
+ * readline.readchunk(prompt, contprompt, is_complete, gen, opts) - reads lines until they make a complete chunk
+ * The first line is read with the prompt and the others with contprompt, which defaults to the prompt.
+ * After every line is_complete(line, state, n) is called with the line, the value it has returned second
+ * the previous time (nil for the first line) and the number of the line in the chunk. It returns true once
+ * the chunk is complete, and the state it needs to tell that for the next line, such as whether
+ * a long string or comment is open, so it doesn't go over the whole chunk every time. The lines are gathered
+ * in a C buffer and the chunk is only made a Lua string once, joined with newlines.
+ * Completion and the options work like for readline.readline, plus:
+ *   history - if not false, add the chunk to the history list as a single entry, as readline.addhistory would
+ * Returns the chunk and true, the lines read so far and false if the input ends before the chunk is complete,
+ * or nil if it ends before any line or the input is cancelled
+ */
+static int lua_readchunk(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	luaL_checktype(L, 3, LUA_TFUNCTION);
+	lua_settop(L, 5);
+	const char *prompt = lua_tolstring(L, 1, NULL);
+	const char *contprompt = lua_isnil(L, 2) ? prompt : lua_tolstring(L, 2, NULL);
+	int fast = usefastpath(L, ctx, 5), complete = 0, res;
+	int history = 1;
+	if (lua_istable(L, 5)) {
+		lua_getfield(L, 5, "history");
+		history = lua_isnil(L, -1) || lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	size_t len = 0, n, lines = 0;
+	/* The state of the predicate */
+	lua_pushnil(L);
+	for (;;) {
+		if (fast)
+			res = readline_fast(L, ctx, lines ? contprompt : prompt);
+		else {
+			ctx_enter(L, ctx);
+			if (globalCallbackCtx || globalInstalledSessions) {
+				ctx_leave(ctx);
+				return luaL_error(L, "A callback handler is installed");
+			}
+			lua_setgenerator(L, ctx, 4, 5);
+			/* The SIGINT handler is kept for the next line */
+			res = readline_interactive(L, ctx, lines ? contprompt : prompt, 1);
+			if (!res)
+				sigint_restore();
+			ctx_leave(ctx);
+			ctx_rethrow(L, ctx);
+			if (ctx->cancelled)
+				return 0;
+		}
+		if (!res || lua_isnil(L, -1))
+			break;
+		const char *line = lua_tolstring(L, -1, &n);
+		if (len + n + 2 > ctx->chunkcap) {
+			size_t cap = ctx->chunkcap ? ctx->chunkcap : 256;
+			while (cap < len + n + 2)
+				cap *= 2;
+			char *buf = (char*) realloc(ctx->chunkbuf, cap);
+			if (!buf)
+				return luaL_error(L, "Out of memory");
+			ctx->chunkbuf = buf;
+			ctx->chunkcap = cap;
+		}
+		if (lines)
+			ctx->chunkbuf[len++] = '\n';
+		memcpy(ctx->chunkbuf + len, line, n);
+		len += n;
+		ctx->chunkbuf[len] = '\0';
+		lines++;
+		/* is_complete(line, state, n) replaces the state */
+		lua_checkstack(L, 4);
+		lua_pushvalue(L, 3);
+		lua_insert(L, -2);
+		lua_pushvalue(L, 6);
+		lua_pushnumber(L, (lua_Number) lines);
+		lua_call(L, 3, 2);
+		lua_replace(L, 6);
+		complete = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		if (complete)
+			break;
+	}
+	if (!fast && res) {
+		ctx_enter(L, ctx);
+		sigint_restore();
+		ctx_leave(ctx);
+	}
+	if (!lines)
+		return 0;
+	if (history && len) {
+		ctx_enter(L, ctx);
+		history_push(ctx, ctx->chunkbuf);
+		ctx_leave(ctx);
+	}
+	lua_pushlstring(L, ctx->chunkbuf, len);
+	lua_pushboolean(L, complete);
+	return 2;
+}
+
+/**
+ * Line handler for the libreadline callback interface
+ * Calls the Lua handler stored by lua_handlerinstall with the line read, or nil on EOF.
+ * Errors are caught so that they don't unwind through libreadline, lua_readchar rethrows them
+ */
+static void callback_linehandler(char *line)
+{
+	context_t *ctx = globalCtx;
+	session_t *s = globalSession;
+	lua_State *L = ctx->L;
+	hist_edited();
+	if (s) {
+		/* The line is for the handler of the session */
+		lua_checkstack(L, 2);
+		getref(L, s->handler);
+		lua_pushstring(L, line);
+		free(line);
+		if (lua_pcall(L, 1, 0, 0))
+			ctx_fail(ctx);
+		return;
+	}
+	if (ctx->cowaiting) {
+		/* The line is for readline.co_readline, keep it for co_step */
+		ctx->coline = line;
+		ctx->codone = 1;
+		return;
+	}
+	lua_checkstack(L, 2);
+	getref(L, ctx->handler);
+	lua_pushstring(L, line);
+	free(line);
+	if (lua_pcall(L, 1, 0, 0))
+		ctx_fail(ctx);
+}
+
+/**
+ * Sets up completion and installs callback_linehandler as the libreadline line handler
+ * Expects libreadline to be acquired with ctx_enter
+ */
+static void callback_install(lua_State *L, context_t *ctx, const char *prompt, int gen, int opts)
+{
+	session_t *s = ctx->session;
+	lua_setgenerator(L, ctx, gen, opts);
+	if (s) {
+		/* Installing the handler again keeps libreadline in the callback mode for the other sessions */
+		rl_callback_handler_install(prompt, callback_linehandler);
+		/* libreadline only preps the terminal for the first handler */
+		session_prepterm(0);
+		if (!s->installed)
+			globalInstalledSessions++;
+		s->installed = 1;
+		s->serial = globalSerial;
+		return;
+	}
+	if (ctx->installed)
+		rl_callback_handler_remove();
+	rl_callback_handler_install(prompt, callback_linehandler);
+	ctx->installed = 1;
+	globalCallbackCtx = ctx;
+}
+
+/**
+ * Acquires libreadline for the callback interface, checking that the handler doesn't conflict with the installed ones:
+ * sessions can all have handlers at once, but not together with the default streams
+ */
+static void callback_enter(lua_State *L, context_t *ctx)
+{
+	ctx_enter(L, ctx);
+	if (ctx->session ? globalCallbackCtx != NULL : globalInstalledSessions > 0) {
+		ctx_leave(ctx);
+		luaL_error(L, "A callback handler is installed for other streams");
+	}
+	if (globalCallbackCtx && globalCallbackCtx != ctx) {
+		ctx_leave(ctx);
+		luaL_error(L, "A callback handler is installed by another Lua state");
+	}
+}
+
+/**
+ * Removes the callback handler of the current session, expects libreadline to be acquired for the session
+ */
+static void session_removehandler(lua_State *L, session_t *s)
+{
+	if (!s->installed)
+		return;
+	if (globalInstalledSessions == 1)
+		rl_callback_handler_remove();
+	else {
+		/* Other sessions still get their lines through the handler, only take this one out of the callback mode */
+		session_deprepterm();
+		RL_UNSETSTATE(RL_STATE_CALLBACK);
+	}
+	s->installed = 0;
+	globalInstalledSessions--;
+	luaL_unref(L, LUA_REGISTRYINDEX, s->handler);
+	luaL_unref(L, LUA_REGISTRYINDEX, s->generator);
+	luaL_unref(L, LUA_REGISTRYINDEX, s->opts);
+	s->handler = s->generator = s->opts = LUA_NOREF;
+}
+
+/**
+ * Installs a line handler for the libreadline callback interface
+ * Args:
+ * 1) Prompt - a string to display before the user input area
+ * 2) Handler - a Lua function to be called with every line read, or with nil on EOF
+ * 3) Generator - the same as for readline.readline
+ * 4) Options - the same as for readline.readline
+ * Input is then processed by calling readline.readchar whenever the input descriptor (see readline.fileno) is readable
+ */
+static int lua_handlerinstall(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	const char *prompt = luaL_optstring(L, 1, "");
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	if (ctx->cowaiting)
+		return luaL_error(L, "readline.co_readline is in progress");
+	callback_enter(L, ctx);
+	lua_checkstack(L, 1);
+	lua_pushvalue(L, 2);
+	if (ctx->session) {
+		/* Keep the completion of the session to set it up again once another session has changed it */
+		session_t *s = ctx->session;
+		setref(L, &s->handler);
+		lua_pushvalue(L, 3);
+		setref(L, &s->generator);
+		lua_pushvalue(L, 4);
+		setref(L, &s->opts);
+	} else
+		setref(L, &ctx->handler);
+	callback_install(L, ctx, prompt, 3, 4);
+	ctx_leave(ctx);
+	return 0;
+}
+
+/**
+ * Reads the available input character and lets libreadline process it
+ * Calls the line handler if a line has been completed
+ */
+static int lua_readchar(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	session_t *s = ctx->session;
+	if (!(s ? s->installed : ctx->installed))
+		return luaL_error(L, "No callback handler is installed");
+	ctx_enter(L, ctx);
+	/* The generator and the line handler are called on this Lua thread */
+	ctx->L = L;
+	if (s && s->serial != globalSerial) {
+		lua_checkstack(L, 2);
+		getref(L, s->generator);
+		getref(L, s->opts);
+		lua_setgenerator(L, ctx, lua_gettop(L) - 1, lua_gettop(L));
+		lua_pop(L, 2);
+		s->serial = globalSerial;
+	}
+	histlog_navigated();
+	rl_callback_read_char();
+	ctx_leave(ctx);
+	ctx_rethrow(L, ctx);
+	return 0;
+}
+
+/**
+ * Removes the line handler installed by readline.handlerinstall and restores the terminal settings
+ */
+static int lua_handlerremove(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	ctx_enter(L, ctx);
+	if (ctx->session) {
+		session_removehandler(L, ctx->session);
+		ctx_leave(ctx);
+		return 0;
+	}
+	if (ctx->installed) {
+		rl_callback_handler_remove();
+		ctx->installed = 0;
+		globalCallbackCtx = NULL;
+	}
+	/* An abandoned readline.co_readline is cancelled too */
+	ctx->cowaiting = 0;
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->handler);
+	ctx->handler = LUA_NOREF;
+	ctx_leave(ctx);
+	return 0;
+}
+
+/**
+ * Returns the file descriptor libreadline reads the input from, to be watched by an event loop
+ */
+static int lua_fileno(lua_State *L)
+{
+	lua_pushnumber(L, (lua_Number) fileno(instream(getcontext(L))));
+	return 1;
+}
+
+/**
+ * Starts readline.co_readline: installs the callback handler for the calling coroutine
+ * Args are the same as for readline.readline
+ * Returns the input file descriptor that the coroutine is going to wait for
+ */
+static int lua_costart(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	const char *prompt = luaL_optstring(L, 1, "");
+	if (ctx->installed || ctx->session)
+		return luaL_error(L, "A callback handler is installed");
+	lua_checkstack(L, 1);
+	if (lua_pushthread(L))
+		return luaL_error(L, "readline.co_readline must be called from a coroutine");
+	lua_pop(L, 1);
+	callback_enter(L, ctx);
+	callback_install(L, ctx, prompt, 2, 3);
+	ctx->cowaiting = 1;
+	ctx->codone = 0;
+	ctx->coline = NULL;
+	ctx_leave(ctx);
+	return lua_fileno(L);
+}
+
+/**
+ * Processes the available input for readline.co_readline
+ * Pushes the line (or nil on EOF) and returns 1 when it has been completed, returns 0 otherwise
+ */
+static int co_step(lua_State *L, context_t *ctx)
+{
+	if (!ctx->cowaiting)
+		return luaL_error(L, "readline.co_readline has been cancelled");
+	ctx_enter(L, ctx);
+	ctx->L = L;
+	histlog_navigated();
+	rl_callback_read_char();
+	if (!ctx->codone && !ctx->failed) {
+		ctx_leave(ctx);
+		return 0;
+	}
+	char *line = ctx->coline;
+	ctx->cowaiting = 0;
+	ctx->codone = 0;
+	ctx->coline = NULL;
+	rl_callback_handler_remove();
+	ctx->installed = 0;
+	globalCallbackCtx = NULL;
+	ctx_leave(ctx);
+	if (ctx->failed) {
+		free(line);
+		ctx_rethrow(L, ctx);
+	}
+	lua_checkstack(L, 1);
+	lua_pushstring(L, line);
+	free(line);
+	return 1;
+}
+
+/**
+ * Processes the available input for readline.co_readline through co_step, called with ctx_call
+ * or by the Lua implementation of readline.co_readline. Returns true and the line read if a line has been completed, false otherwise
+ */
+static int lua_costep(lua_State *L)
+{
+	if (co_step(L, getcontext(L))) {
+		lua_pushboolean(L, 1);
+		lua_insert(L, -2);
+		return 2;
+	}
+	lua_pushboolean(L, 0);
+	return 1;
+}
+
+#if LUA_VERSION_NUM >= 502
+#if LUA_VERSION_NUM >= 503
+static int lua_cocontinue(lua_State *L, int status, lua_KContext ctx);
+#else
+static int lua_cocontinue(lua_State *L);
+#endif
+
+/**
+ * Continuation of readline.co_readline, run every time the coroutine is resumed
+ * The coroutine is expected to be resumed when the input descriptor it has yielded is readable
+ */
+#if LUA_VERSION_NUM >= 503
+static int lua_cocontinue(lua_State *L, int status, lua_KContext ctx)
+#else
+static int lua_cocontinue(lua_State *L)
+#endif
+{
+#if LUA_VERSION_NUM >= 503
+	/* The continuation is always entered after a yield, with no context */
+	(void) status;
+	(void) ctx;
+#endif
+	/* Drop the values passed to coroutine.resume */
+	lua_settop(L, 0);
+	lua_checkstack(L, 2);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_pushcclosure(L, lua_costep, 1);
+	ctx_call(L, getcontext(L), 0, 2);
+	if (lua_toboolean(L, 1))
+		return 1;
+	lua_settop(L, 0);
+	lua_fileno(L);
+	return lua_yieldk(L, 1, 0, lua_cocontinue);
+}
+
+/**
+ * readline.co_readline(prompt, gen, opts) - reads a line without blocking the process
+ * Yields the calling coroutine with the input file descriptor until a line is completed,
+ * the coroutine is to be resumed whenever the descriptor is readable.
+ * Returns the line read, or nil on EOF
+ */
+static int lua_coreadline(lua_State *L)
+{
+	/* Not called through lua_guarded to be able to yield, so the start is guarded instead */
+	lua_checkstack(L, 2);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_pushcclosure(L, lua_costart, 1);
+	lua_insert(L, 1);
+	ctx_call(L, getcontext(L), lua_gettop(L) - 1, 1);
+	return lua_yieldk(L, 1, 0, lua_cocontinue);
+}
+#else
+/**
+ * Lua 5.1 can't yield from C functions across calls, so readline.co_readline is a Lua function
+ * built on top of lua_costart and lua_costep
+ */
+static const char CO_READLINE[] =
+	"local start, step = ...\n"
+	"local yield = coroutine.yield\n"
+	"return function(prompt, gen, opts)\n"
+	"	local fd = start(prompt, gen, opts)\n"
+	"	while true do\n"
+	"		yield(fd)\n"
+	"		local done, line = step()\n"
+	"		if done then return line end\n"
+	"	end\n"
+	"end\n";
+#endif
+
+/**
+ * Wrapper function to get rl_readline_name variable
+ */
+static int lua_getname(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	ctx_enter(L, ctx);
+	const char *name = rl_readline_name;
+	ctx_leave(ctx);
+	lua_pushstring(L, name);
+	return 1;
+}
+
+/**
+ * Wrapper function to set rl_readline_name variable
+ */
+static int lua_setname(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	const char *name = lua_tolstring(L, 1, NULL);
+	ctx_enter(L, ctx);
+	if (rl_readline_name)
+		free((void*) rl_readline_name);
+	rl_readline_name = clonestr(name);
+	ctx_leave(ctx);
+	if (!rl_readline_name)
+		return luaL_error(L, "Out of memory");
+	return 0;
+}
+
+static const char *const DUPS_MODES[] = {"keep", "ignoredups", "ignorealldups", "erasedups", NULL};
+
+/**
+ * FNV-1a hash of a string
+ */
+static uint32_t strhash(const char *str, size_t len)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char) str[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+ * Inserts an entry into the hash set, which must have a free slot
+ */
+static void hmirror_hashinsert(hmirror_t *m, hentry_t *e)
+{
+	size_t mask = m->slotcap - 1, i = e->hash & mask;
+	while (m->slots[i])
+		i = (i + 1) & mask;
+	m->slots[i] = e;
+}
+
+/**
+ * Removes an entry from the hash set, shifting the following entries back to keep the probe chains intact
+ */
+static void hmirror_hashremove(hmirror_t *m, hentry_t *e)
+{
+	size_t mask = m->slotcap - 1, i = e->hash & mask, j;
+	while (m->slots[i] != e)
+		i = (i + 1) & mask;
+	m->slots[i] = NULL;
+	for (j = (i + 1) & mask; m->slots[j]; j = (j + 1) & mask) {
+		size_t home = m->slots[j]->hash & mask;
+		/* Move the entry into the hole if the hole is on its probe chain */
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			m->slots[i] = m->slots[j];
+			m->slots[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+/**
+ * Finds an entry equal to a string in the hash set
+ */
+static hentry_t* hmirror_find(const hmirror_t *m, const char *str, size_t len, uint32_t hash)
+{
+	size_t mask = m->slotcap - 1, i;
+	if (!m->slotcap)
+		return NULL;
+	for (i = hash & mask; m->slots[i]; i = (i + 1) & mask) {
+		hentry_t *e = m->slots[i];
+		if (e->hash == hash && e->len == len && memcmp(e->str, str, len) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+/**
+ * Frees all the entries of the mirror and marks it invalid
+ */
+static void hmirror_clear(hmirror_t *m)
+{
+	size_t i;
+	for (i = 0; i < m->n; i++)
+		free(m->v[i]);
+	free(m->v);
+	free(m->slots);
+	free(m->sorted);
+	m->v = NULL;
+	m->slots = NULL;
+	m->sorted = NULL;
+	m->n = m->cap = m->slotcap = m->nsorted = 0;
+	m->bytes = 0;
+	m->indexed = 0;
+	m->valid = 0;
+	m->suspect = 0;
+}
+
+/**
+ * Makes room for one more entry in the mirror
+ * Returns zero if memory allocation failed
+ */
+static int hmirror_reserve(hmirror_t *m)
+{
+	if (m->n >= m->cap) {
+		size_t cap = m->cap ? m->cap * 2 : 64;
+		hentry_t **v = (hentry_t**) realloc(m->v, cap * sizeof(hentry_t*));
+		if (!v)
+			return 0;
+		m->v = v;
+		m->cap = cap;
+	}
+	/* Keep the hash set at most half full */
+	if ((m->n + 1) * 2 > m->slotcap) {
+		size_t cap = m->slotcap ? m->slotcap * 2 : 128, i;
+		hentry_t **slots = (hentry_t**) calloc(cap, sizeof(hentry_t*));
+		if (!slots)
+			return 0;
+		free(m->slots);
+		m->slots = slots;
+		m->slotcap = cap;
+		for (i = 0; i < m->n; i++)
+			hmirror_hashinsert(m, m->v[i]);
+	}
+	return 1;
+}
+
+/**
+ * Appends a copy of the line of a history list entry to the mirror
+ * Returns zero if memory allocation failed
+ */
+static int hmirror_push(hmirror_t *m, const HIST_ENTRY *h)
+{
+	const char *str = h->line;
+	size_t len = strlen(str);
+	if (!hmirror_reserve(m))
+		return 0;
+	hentry_t *e = (hentry_t*) malloc(sizeof(hentry_t) + len);
+	if (!e)
+		return 0;
+	e->seq = m->nextseq++;
+	e->hash = strhash(str, len);
+	e->len = len;
+	e->entry = h;
+	e->line = str;
+	memcpy(e->str, str, len);
+	e->str[len] = '\0';
+	m->v[m->n++] = e;
+	m->bytes += len + 1;
+	hmirror_hashinsert(m, e);
+	return 1;
+}
+
+/**
+ * Makes sure the mirror matches the history list, rebuilding it if needed
+ * Returns zero if memory allocation failed
+ */
+static int hmirror_sync(hmirror_t *m)
+{
+	HIST_ENTRY **list = history_list();
+	size_t i;
+	if (m->valid && m->n == (size_t) history_length) {
+		if (!m->suspect)
+			return 1;
+		/* libreadline replaces the entries it edits, the copies of the ones left alone are still good */
+		for (i = 0; i < m->n && m->v[i]->entry == list[i] && m->v[i]->line == list[i]->line; i++)
+			;
+		if (i == m->n) {
+			m->suspect = 0;
+			return 1;
+		}
+	}
+	hmirror_clear(m);
+	for (i = 0; list && i < (size_t) history_length; i++)
+		if (!hmirror_push(m, list[i])) {
+			hmirror_clear(m);
+			return 0;
+		}
+	m->valid = 1;
+	return 1;
+}
+
+/**
+ * Returns the position of an entry in the mirror, which is its offset in the history list
+ */
+static size_t hmirror_position(const hmirror_t *m, const hentry_t *e)
+{
+	size_t lo = 0, hi = m->n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (m->v[mid]->seq < e->seq)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * Compares two entries by the line and then by seq, the order of the search index
+ */
+static int cmphentry(const hentry_t *a, const hentry_t *b)
+{
+	int res = strcmp(a->str, b->str);
+	if (res)
+		return res;
+	return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+/**
+ * qsort comparator for an array of entry pointers in the search index order
+ */
+static int cmphentryptr(const void *a, const void *b)
+{
+	return cmphentry(*(hentry_t* const*) a, *(hentry_t* const*) b);
+}
+
+/**
+ * qsort comparator for an array of entry pointers putting the newest entries first
+ */
+static int cmphentrynewest(const void *a, const void *b)
+{
+	unsigned long sa = (*(hentry_t* const*) a)->seq, sb = (*(hentry_t* const*) b)->seq;
+	return sa > sb ? -1 : sa < sb;
+}
+
+/**
+ * Returns the position of an indexed entry in the search index
+ */
+static size_t hmirror_sortedposition(const hmirror_t *m, const hentry_t *e)
+{
+	size_t lo = 0, hi = m->nsorted;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (cmphentry(m->sorted[mid], e) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * Brings the search index up to date, merging the entries appended since the last search into it
+ * Returns zero if memory allocation failed
+ */
+static int hmirror_index(hmirror_t *m)
+{
+	size_t first = 0, k, i, j, d;
+	if (m->indexed) {
+		/* The entries not indexed yet are at the end of the mirror */
+		size_t lo = 0, hi = m->n;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (m->v[mid]->seq < m->indexedseq)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		first = lo;
+	} else
+		m->nsorted = 0;
+	k = m->n - first;
+	hentry_t **sorted = (hentry_t**) realloc(m->sorted, (m->nsorted + k + 1) * sizeof(hentry_t*));
+	if (!sorted)
+		return 0;
+	m->sorted = sorted;
+	/* Sort the new entries at the end of the array, then merge them in from the back */
+	hentry_t **tail = sorted + m->nsorted;
+	memcpy(tail, m->v + first, k * sizeof(hentry_t*));
+	qsort(tail, k, sizeof(hentry_t*), cmphentryptr);
+	if (m->nsorted && k) {
+		hentry_t **tmp = (hentry_t**) malloc(k * sizeof(hentry_t*));
+		if (!tmp)
+			return 0;
+		memcpy(tmp, tail, k * sizeof(hentry_t*));
+		i = m->nsorted;
+		j = k;
+		d = m->nsorted + k;
+		while (j > 0) {
+			if (i > 0 && cmphentry(sorted[i-1], tmp[j-1]) > 0)
+				sorted[--d] = sorted[--i];
+			else
+				sorted[--d] = tmp[--j];
+		}
+		free(tmp);
+	}
+	m->nsorted += k;
+	m->indexedseq = m->nextseq;
+	m->indexed = 1;
+	return 1;
+}
+
+/**
+ * Returns the total size of the lines of the current history list including the terminating NULs,
+ * counting them if the list has been changed behind the back of the library
+ */
+static size_t hist_bytes(hist_t *h)
+{
+	if (h->counted != history_length) {
+		HIST_ENTRY **list = history_list();
+		int i;
+		h->bytes = 0;
+		for (i = 0; list && i < history_length; i++)
+			h->bytes += strlen(list[i]->line) + 1;
+		h->counted = history_length;
+	}
+	return h->bytes;
+}
+
+/**
+ * Removes the entry at the given offset from the mirror, the history list entry being removed already
+ */
+static void hmirror_remove(hmirror_t *m, size_t pos)
+{
+	hentry_t *e = m->v[pos];
+	hmirror_hashremove(m, e);
+	if (m->indexed && e->seq < m->indexedseq) {
+		size_t i = hmirror_sortedposition(m, e);
+		memmove(m->sorted + i, m->sorted + i + 1, (m->nsorted - i - 1) * sizeof(hentry_t*));
+		m->nsorted--;
+	}
+	memmove(m->v + pos, m->v + pos + 1, (m->n - pos - 1) * sizeof(hentry_t*));
+	m->n--;
+	m->bytes -= e->len + 1;
+	free(e);
+}
+
+/**
+ * Removes the history entry at the given offset from the history list, the mirror if it's in sync
+ * and the total size of the lines if it's counted
+ */
+static void hist_remove(hist_t *h, size_t pos)
+{
+	int synced = h->mirror.valid && h->mirror.n == (size_t) history_length;
+	HIST_ENTRY *e = remove_history((int) pos);
+	if (!e)
+		return;
+	if (h->counted == history_length + 1) {
+		h->bytes -= strlen(e->line) + 1;
+		h->counted--;
+	}
+	free_history_entry(e);
+	if (synced)
+		hmirror_remove(&h->mirror, pos);
+	else
+		h->mirror.valid = 0;
+}
+
+/**
+ * Evicts the oldest history entries until the total size of the lines fits readline.historylimit
+ * The newest entry is always kept
+ */
+static void history_enforcelimit(context_t *ctx)
+{
+	if (ctx->historymaxbytes)
+		while (history_length > 1 && hist_bytes(ctx->hist) > ctx->historymaxbytes)
+			hist_remove(ctx->hist, 0);
+}
+
+/**
+ * Adds a line to the history list according to the duplicate handling mode, keeping the mirror in sync
+ */
+static void history_push(context_t *ctx, const char *str)
+{
+	hist_t *h = ctx->hist;
+	hmirror_t *m = &h->mirror;
+	size_t len = strlen(str);
+	if (ctx->dupsmode == DUPS_IGNORE) {
+		/* Only the last entry needs to be checked */
+		HIST_ENTRY *last = history_get(history_base + history_length - 1);
+		if (last && strlen(last->line) == len && memcmp(last->line, str, len) == 0)
+			return;
+	}
+	/* Duplicates are kept if there's no memory for the mirror */
+	if ((m->valid || ctx->dupsmode == DUPS_IGNOREALL || ctx->dupsmode == DUPS_ERASE) && hmirror_sync(m)) {
+		uint32_t hash = strhash(str, len);
+		hentry_t *e;
+		if (ctx->dupsmode == DUPS_IGNOREALL && hmirror_find(m, str, len, hash))
+			return;
+		if (ctx->dupsmode == DUPS_ERASE)
+			while ((e = hmirror_find(m, str, len, hash)))
+				hist_remove(h, hmirror_position(m, e));
+	}
+	/* Evict the oldest entry ourselves rather than let a stifled history do it behind our back */
+	if (history_is_stifled() && history_length > 0 && history_length >= history_max_entries)
+		hist_remove(h, 0);
+	add_history(str);
+	if (h->counted == history_length - 1) {
+		h->bytes += len + 1;
+		h->counted++;
+	}
+	if (m->valid && m->n == (size_t) history_length - 1 &&
+		!hmirror_push(m, history_get(history_base + history_length - 1)))
+		hmirror_clear(m);
+	history_enforcelimit(ctx);
+	histlog_append(&h->log, str, len);
+	h->added++;
+}
+
+/**
+ * Wrapper for readline addhistory() function
+ * Accepts either a string or an array of strings to be added all at once
+ */
+static int lua_addhistory(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	if (lua_istable(L, 1)) {
+		size_t n = lua_rawlen(L, 1), i;
+		lua_checkstack(L, 1);
+		for (i = 1; i <= n; i++) {
+			lua_rawgeti(L, 1, i);
+			const char *str = lua_tolstring(L, -1, NULL);
+			if (str) {
+				ctx_enter(L, ctx);
+				history_push(ctx, str);
+				ctx_leave(ctx);
+			}
+			lua_pop(L, 1);
+		}
+		return 0;
+	}
+	const char *str = lua_tolstring(L, 1, NULL);
+	if (str) {
+		ctx_enter(L, ctx);
+		history_push(ctx, str);
+		ctx_leave(ctx);
+	}
+	return 0;
+}
+
+/**
+ * readline.stifle(max) - limits the history list to the last max entries
+ * Wrapper for stifle_history()
+ */
+static int lua_stifle(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	int max = (int) luaL_checknumber(L, 1);
+	ctx_enter(L, ctx);
+	stifle_history(max < 0 ? 0 : max);
+	ctx_leave(ctx);
+	return 0;
+}
+
+/**
+ * readline.unstifle() - removes the limit set by readline.stifle
+ * Wrapper for unstifle_history(), returns the previous limit or nil if there was none
+ */
+static int lua_unstifle(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	ctx_enter(L, ctx);
+	int was = history_is_stifled();
+	int max = unstifle_history();
+	ctx_leave(ctx);
+	if (!was)
+		return 0;
+	lua_pushnumber(L, (lua_Number) max);
+	return 1;
+}
+
+/**
+ * readline.historylimit(bytes) - limits the total size of the history lines, 0 or nil removes the limit
+ * The oldest entries are evicted when a new one doesn't fit. Returns the previous limit
+ */
+static int lua_historylimit(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	lua_Number max = luaL_optnumber(L, 1, 0);
+	lua_pushnumber(L, (lua_Number) ctx->historymaxbytes);
+	ctx->historymaxbytes = max > 0 ? (size_t) max : 0;
+	if (ctx->historymaxbytes) {
+		ctx_enter(L, ctx);
+		history_enforcelimit(ctx);
+		ctx_leave(ctx);
+	}
+	return 1;
+}
+
+/**
+ * readline.historystats() - returns a table describing the history list:
+ *   entries - the number of entries
+ *   bytes - the total size of the lines including the terminating NULs
+ *   memory - an estimate of the memory used by the history list and the mirror of it kept by this library
+ *   maxentries - the limit set by readline.stifle, if any
+ *   maxbytes - the limit set by readline.historylimit, if any
+ */
+static int lua_historystats(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	size_t bytes, memory;
+	int length, stifled, maxentries;
+	ctx_enter(L, ctx);
+	hmirror_t *m = &ctx->hist->mirror;
+	bytes = hist_bytes(ctx->hist);
+	memory = bytes + (size_t) history_length * (sizeof(HIST_ENTRY) + sizeof(HIST_ENTRY*));
+	if (m->valid)
+		memory += m->bytes + m->n * sizeof(hentry_t) + m->cap * sizeof(hentry_t*) + m->slotcap * sizeof(hentry_t*);
+	length = history_length;
+	stifled = history_is_stifled();
+	maxentries = history_max_entries;
+	ctx_leave(ctx);
+	lua_checkstack(L, 2);
+	lua_createtable(L, 0, 5);
+	lua_pushnumber(L, (lua_Number) length);
+	lua_setfield(L, -2, "entries");
+	lua_pushnumber(L, (lua_Number) bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushnumber(L, (lua_Number) memory);
+	lua_setfield(L, -2, "memory");
+	if (stifled) {
+		lua_pushnumber(L, (lua_Number) maxentries);
+		lua_setfield(L, -2, "maxentries");
+	}
+	if (ctx->historymaxbytes) {
+		lua_pushnumber(L, (lua_Number) ctx->historymaxbytes);
+		lua_setfield(L, -2, "maxbytes");
+	}
+	return 1;
+}
+
+/**
+ * readline.searchhistory(text, [opts]) - finds the history entries starting with or containing the text
+ * Options:
+ *   substring - if true, find the entries containing the text rather than starting with it
+ *   max - the maximum number of entries to return
+ * Returns an array of the matching lines, newest first, and an array of their offsets in the history list,
+ * the oldest entry having offset 1. Prefix searches use a sorted index of the history maintained
+ * incrementally, substring searches scan the C copies of the lines.
+ * If the history list doesn't have max matching entries, the part of the history log (see readline.historylog)
+ * not materialised yet is scanned as well, and the entries up to the oldest match needed are materialised
+ */
+static int lua_searchhistory(lua_State *L)
+{
+	size_t len, i, k = 0;
+	const char *text = luaL_checklstring(L, 1, &len);
+	int substring = getboolopt(L, 2, "substring");
+	lua_Number max = HUGE_VAL;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "max");
+		if (!lua_isnil(L, -1))
+			max = luaL_checknumber(L, -1);
+		lua_pop(L, 1);
+	}
+	context_t *ctx = getcontext(L);
+	ctx_enter(L, ctx);
+	hmirror_t *m = &ctx->hist->mirror;
+	hentry_t **found = NULL;
+	int pass;
+	for (pass = 0; pass < 2; pass++) {
+		if (!hmirror_sync(m) || (!substring && !hmirror_index(m))) {
+			ctx_leave(ctx);
+			return luaL_error(L, "Out of memory");
+		}
+		k = 0;
+		if (substring) {
+			/* Scan from the newest entry, so the scan can stop at max */
+			found = (hentry_t**) malloc((m->n ? m->n : 1) * sizeof(hentry_t*));
+			if (!found) {
+				ctx_leave(ctx);
+				return luaL_error(L, "Out of memory");
+			}
+			for (i = m->n; i > 0 && k < max; i--)
+				if (m->v[i-1]->len >= len && memmem(m->v[i-1]->str, m->v[i-1]->len, text, len))
+					found[k++] = m->v[i-1];
+		} else {
+			/* The entries starting with the text are contiguous in the index */
+			size_t lo = 0, hi = m->nsorted, first;
+			while (lo < hi) {
+				size_t mid = lo + (hi - lo) / 2;
+				if (strcmp(m->sorted[mid]->str, text) < 0)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			first = lo;
+			while (lo < m->nsorted && strncmp(m->sorted[lo]->str, text, len) == 0)
+				lo++;
+			k = lo - first;
+			found = (hentry_t**) malloc((k ? k : 1) * sizeof(hentry_t*));
+			if (!found) {
+				ctx_leave(ctx);
+				return luaL_error(L, "Out of memory");
+			}
+			memcpy(found, m->sorted + first, k * sizeof(hentry_t*));
+			qsort(found, k, sizeof(hentry_t*), cmphentrynewest);
+			if (k > max)
+				k = (size_t) max;
+		}
+		/* Materialise the entries of the history log up to the oldest one the search still needs, and search again */
+		if (pass || k >= max || !ctx->hist->log.cursor)
+			break;
+		size_t need = histlog_scan(&ctx->hist->log, text, len, substring,
+			max - k >= (lua_Number) SIZE_MAX ? SIZE_MAX : (size_t) (max - k));
+		if (!need)
+			break;
+		free(found);
+		found = NULL;
+		if (!histlog_load(ctx->hist, need)) {
+			ctx_leave(ctx);
+			return luaL_error(L, "Out of memory");
+		}
+	}
+	/* Copy the results out, so that the tables are built with libreadline released */
+	index_t res;
+	index_init(&res);
+	size_t *pos = NULL, bytes = 0;
+	for (i = 0; i < k; i++)
+		bytes += found[i]->len + 1;
+	res.blob = (char*) malloc(bytes ? bytes : 1);
+	res.offs = (uint32_t*) malloc((k ? k : 1) * sizeof(uint32_t));
+	pos = (size_t*) malloc((k ? k : 1) * sizeof(size_t));
+	if (res.blob && res.offs && pos)
+		for (i = 0, bytes = 0; i < k; i++) {
+			memcpy(res.blob + bytes, found[i]->str, found[i]->len + 1);
+			res.offs[i] = (uint32_t) bytes;
+			pos[i] = hmirror_position(m, found[i]) + 1;
+			bytes += found[i]->len + 1;
+		}
+	free(found);
+	ctx_leave(ctx);
+	if (!res.blob || !res.offs || !pos) {
+		index_free(&res);
+		free(pos);
+		return luaL_error(L, "Out of memory");
+	}
+	lua_checkstack(L, 3);
+	lua_createtable(L, (int) k, 0);
+	lua_createtable(L, (int) k, 0);
+	for (i = 0; i < k; i++) {
+		lua_pushstring(L, index_get(&res, i));
+		lua_rawseti(L, -3, (int) i + 1);
+		lua_pushnumber(L, (lua_Number) pos[i]);
+		lua_rawseti(L, -2, (int) i + 1);
+	}
+	index_free(&res);
+	free(pos);
+	return 2;
+}
+
+/**
+ * readline.historydups([mode]) - sets how readline.addhistory treats duplicates and returns the previous mode
+ * Modes:
+ *   keep - add every line (the default)
+ *   ignoredups - don't add a line equal to the last entry
+ *   ignorealldups - don't add a line equal to any entry
+ *   erasedups - remove the entries equal to a line before adding it
+ * The last two keep a hash set of the history entries, so checking for a duplicate doesn't scan the history
+ */
+static int lua_historydups(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	lua_pushstring(L, DUPS_MODES[ctx->dupsmode]);
+	if (!lua_isnoneornil(L, 1))
+		ctx->dupsmode = luaL_checkoption(L, 1, NULL, DUPS_MODES);
+	return 1;
+}
+
+/**
+ * Pushes the result of a history file operation the way the io library does:
+ * true on success, or nil, an error message and the error number
+ */
+static int pushhistoryresult(lua_State *L, int err, const char *path)
+{
+	lua_checkstack(L, 3);
+	if (!err) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	lua_pushnil(L);
+	lua_pushfstring(L, "%s: %s", path ? path : "~/.history", strerror(err));
+	lua_pushnumber(L, (lua_Number) err);
+	return 3;
+}
+
+/**
+ * readline.loadhistory([path]) - appends the lines of a history file to the history list
+ * Wrapper for read_history(), the default path is ~/.history
+ */
+static int lua_loadhistory(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	const char *path = luaL_optstring(L, 1, NULL);
+	ctx_enter(L, ctx);
+	int err = read_history(path);
+	if (!err)
+		ctx->hist->added = 0;
+	/* The mirror and the total size are rebuilt when needed */
+	ctx->hist->mirror.valid = 0;
+	ctx->hist->counted = -1;
+	ctx_leave(ctx);
+	return pushhistoryresult(L, err, path);
+}
+
+/**
+ * readline.savehistory([path]) - writes the whole history list to a history file, replacing it
+ * Wrapper for write_history()
+ */
+static int lua_savehistory(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	const char *path = luaL_optstring(L, 1, NULL);
+	ctx_enter(L, ctx);
+	int err = write_history(path);
+	if (!err)
+		ctx->hist->added = 0;
+	ctx_leave(ctx);
+	return pushhistoryresult(L, err, path);
+}
+
+/**
+ * readline.appendhistory([path], [n]) - appends the last n entries of the history list to a history file
+ * Wrapper for append_history(). By default the entries added since the history was last loaded, saved
+ * or appended are written. The file is created if it doesn't exist
+ */
+static int lua_appendhistory(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	const char *path = luaL_optstring(L, 1, NULL);
+	int hasn = !lua_isnoneornil(L, 2);
+	lua_Number n = luaL_optnumber(L, 2, 0);
+	char *home = NULL;
+	if (!path) {
+		const char *dir = getenv("HOME");
+		home = (char*) malloc(strlen(dir ? dir : ".") + sizeof("/.history"));
+		if (!home)
+			return luaL_error(L, "Out of memory");
+		strcpy(home, dir ? dir : ".");
+		strcat(home, "/.history");
+	}
+	ctx_enter(L, ctx);
+	if (!hasn)
+		n = (lua_Number) ctx->hist->added;
+	if (n > history_length)
+		n = history_length;
+	int err = 0;
+	if (n > 0) {
+		err = append_history((int) n, path);
+		if (err == ENOENT) {
+			/* append_history doesn't create the file */
+			FILE *fd = fopen(path ? path : home, "a");
+			if (fd) {
+				fclose(fd);
+				err = append_history((int) n, path);
+			} else
+				err = errno;
+		}
+		if (!err)
+			ctx->hist->added = 0;
+	}
+	ctx_leave(ctx);
+	free(home);
+	return pushhistoryresult(L, err, path);
+}
+
+/**
+ * readline.historylog(path, [opts]) - attaches an on-disk history log to the history list, replacing the one it has,
+ * or detaches it if the path is nil
+ * The log is a history file kept memory-mapped and read backwards on demand: its entries are copied
+ * to the history list a chunk at a time, when readline navigates to the oldest entry the list has
+ * or readline.searchhistory runs out of the entries in the list. So attaching a log takes the same time and memory
+ * whatever its size, and only the part of it being used is paged in.
+ * The lines added with readline.addhistory are appended to the file as they are added, one write per line,
+ * so several processes can share a log. The lines others append are seen when it's attached again.
+ * The file has the format written by readline.savehistory, with a timestamp line before every entry
+ * if history_write_timestamps and history_comment_char are set, so it can be read with readline.loadhistory as well.
+ * It should only be trimmed by replacing the file, as readline.truncatehistory does, not in place
+ * Options:
+ *   chunk - the number of entries copied to the history list at a time, 256 by default
+ *   append - whether the lines added are appended to the file, true by default. The file is created if it
+ *            doesn't exist. If false, it's opened read-only
+ * Returns true, or nil, an error message and the error number
+ */
+static int lua_historylog(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	const char *path = luaL_optstring(L, 1, NULL);
+	lua_Number chunk = HISTLOG_CHUNK;
+	int append = 1;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "chunk");
+		if (!lua_isnil(L, -1))
+			chunk = luaL_checknumber(L, -1);
+		lua_getfield(L, 2, "append");
+		if (!lua_isnil(L, -1))
+			append = lua_toboolean(L, -1);
+		lua_pop(L, 2);
+	}
+	ctx_enter(L, ctx);
+	int err = 0;
+	if (path)
+		err = histlog_open(&ctx->hist->log, path, chunk >= 1 ? (size_t) chunk : 1, append);
+	else
+		histlog_close(&ctx->hist->log);
+	ctx_leave(ctx);
+	return pushhistoryresult(L, err, path);
+}
+
+/**
+ * readline.truncatehistory([path], max) - truncates a history file to its last max lines
+ * Wrapper for history_truncate_file()
+ */
+static int lua_truncatehistory(lua_State *L)
+{
+	const char *path = luaL_optstring(L, 1, NULL);
+	int max = (int) luaL_checknumber(L, 2);
+	context_t *ctx = getcontext(L);
+	ctx_enter(L, ctx);
+	int err = history_truncate_file(path, max);
+	ctx_leave(ctx);
+	return pushhistoryresult(L, err, path);
+}
+
+/**
+ * Checks if the last completion has been cut short
+ * Returns true and "limit" if it has been stopped at the limit option or had more fuzzy matches than it has offered,
+ * true and "timeout" if it has run out of the complete_timeout_ms budget, or false
+ */
+static int lua_truncated(lua_State *L)
+{
+	int truncated = getcontext(L)->truncated;
+	lua_pushboolean(L, truncated != TRUNCATED_NONE);
+	if (truncated == TRUNCATED_NONE)
+		return 1;
+	lua_pushstring(L, truncated == TRUNCATED_LIMIT ? "limit" : "timeout");
+	return 2;
+}
+
+/**
+ * Sets a field of the table on top of the stack to a number
+ */
+static void setnumfield(lua_State *L, const char *name, lua_Number value)
+{
+	lua_pushnumber(L, value);
+	lua_setfield(L, -2, name);
+}
+
+/**
+ * readline.stats([what]) - returns the completion and input statistics of the Lua state as a table
+ * true starts collecting them, false stops and "reset" zeroes them before they are returned.
+ * They are off by default. The fields are:
+ *    enabled - whether the statistics are being collected
+ *    completions - the completions requested by libreadline
+ *    generator_calls, generator_ms - the calls of the generator functions and the time spent in them
+ *    iterator_steps, iterator_ms - the calls of the iterators and the time spent in them
+ *    scanned, matched - the candidates of table generators checked against the prefix and the ones matching it
+ *    match_bytes - the memory allocated for the matches handed over to libreadline
+ *    reads, read_ms - the calls of readline() and the time they have been waiting for the input
+ *    cancelled - the readline() calls cancelled by SIGINT
+ */
+static int lua_stats(lua_State *L)
+{
+	stats_t *st = &getcontext(L)->stats;
+	if (lua_isboolean(L, 1))
+		st->enabled = lua_toboolean(L, 1);
+	else if (!lua_isnoneornil(L, 1)) {
+		if (strcmp(luaL_checkstring(L, 1), "reset") != 0)
+			return luaL_argerror(L, 1, "expected a boolean or \"reset\"");
+		int enabled = st->enabled;
+		memset(st, 0, sizeof(stats_t));
+		st->enabled = enabled;
+	}
+	lua_checkstack(L, 3);
+	lua_createtable(L, 0, 12);
+	lua_pushboolean(L, st->enabled);
+	lua_setfield(L, -2, "enabled");
+	setnumfield(L, "completions", (lua_Number) st->completions);
+	setnumfield(L, "generator_calls", (lua_Number) st->inits);
+	setnumfield(L, "generator_ms", (lua_Number) st->initns / 1e6);
+	setnumfield(L, "iterator_steps", (lua_Number) st->steps);
+	setnumfield(L, "iterator_ms", (lua_Number) st->stepns / 1e6);
+	setnumfield(L, "scanned", (lua_Number) st->scanned);
+	setnumfield(L, "matched", (lua_Number) st->matched);
+	setnumfield(L, "match_bytes", (lua_Number) st->matchbytes);
+	setnumfield(L, "reads", (lua_Number) st->reads);
+	setnumfield(L, "read_ms", (lua_Number) st->readns / 1e6);
+	setnumfield(L, "cancelled", (lua_Number) st->cancels);
+	return 1;
+}
+
+/**
+ * Drops the matches kept by the completion cache
+ */
+static int lua_clearcache(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	ctx_enter(L, ctx);
+	cache_clear(L, ctx);
+	ctx_leave(ctx);
+	return 0;
+}
+
+/**
+ * Reads the names in a directory, except . and .., into an index userdata pushed onto the stack
+ * Returns 1 on success, 0 if the directory can't be read and -1 if memory allocation failed, pushing nothing then
+ */
+static int dircache_read(lua_State *L, const char *path)
+{
+	DIR *dir = opendir(path);
+	struct dirent *de;
+	matches_t names;
+	int ok = 1;
+	if (!dir)
+		return 0;
+	matches_init(&names);
+	while (ok && (de = readdir(dir)))
+		if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+			ok = matches_add(&names, de->d_name, strlen(de->d_name));
+	closedir(dir);
+	lua_checkstack(L, 2);
+	index_t *idx = (index_t*) lua_newuserdata(L, sizeof(index_t));
+	index_init(idx);
+	luaL_getmetatable(L, INDEX_METATABLE);
+	lua_setmetatable(L, -2);
+	ok = ok && index_fromvector(idx, names.v ? names.v + 1 : NULL, names.n);
+	matches_free(&names);
+	if (!ok) {
+		lua_pop(L, 1);
+		return -1;
+	}
+	return 1;
+}
+
+/**
+ * Pushes the index of the names in a directory, from the cache if the listing there is still valid
+ * Returns 1 on success, 0 if the directory can't be read and -1 if memory allocation failed, pushing nothing then
+ */
+static int dircache_get(lua_State *L, context_t *ctx, const char *path)
+{
+	uint64_t now = clock_ms();
+	dircache_t *e = NULL, *victim = &ctx->dircache[0];
+	struct stat st;
+	int i, res;
+	lua_checkstack(L, 2);
+	for (i = 0; i < DIRCACHE_SIZE && !e; i++) {
+		dircache_t *c = &ctx->dircache[i];
+		if (c->path && strcmp(c->path, path) == 0)
+			e = c;
+		else if (victim->path && (!c->path || c->checked < victim->checked))
+			/* Evict the least recently used listing, if there's no free slot */
+			victim = c;
+	}
+	if (e && ctx->dirttl && now - e->checked < ctx->dirttl) {
+		getref(L, e->listing);
+		return 1;
+	}
+	/* Check the time before reading, so that a change while reading shows on the next check */
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+		return 0;
+	if (e && e->mtime.tv_sec == st.st_mtim.tv_sec && e->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+		e->checked = now;
+		getref(L, e->listing);
+		return 1;
+	}
+	res = dircache_read(L, path);
+	if (res <= 0)
+		return res;
+	if (!e) {
+		char *copy = clonestr(path);
+		if (!copy)
+			/* Can't cache the listing, but it's still there to use */
+			return 1;
+		e = victim;
+		free(e->path);
+		e->path = copy;
+	}
+	lua_pushvalue(L, -1);
+	setref(L, &e->listing);
+	e->mtime = st.st_mtim;
+	e->checked = now;
+	return 1;
+}
+
+/**
+ * Drops the directory listings cached by readline.files, releasing them through the calling Lua thread
+ */
+static void dircache_clear(lua_State *L, context_t *ctx)
+{
+	int i;
+	for (i = 0; i < DIRCACHE_SIZE; i++) {
+		free(ctx->dircache[i].path);
+		ctx->dircache[i].path = NULL;
+		luaL_unref(L, LUA_REGISTRYINDEX, ctx->dircache[i].listing);
+		ctx->dircache[i].listing = LUA_NOREF;
+	}
+}
+
+/**
+ * The iterator function returned by readline.files
+ * Upvalues:
+ * 1) The index of the names in the directory
+ * 2) The position of the next name to check
+ * 3) The prefix of the names
+ * 4) The directory part of the text, prepended to the names
+ * 5) Whether the hidden files are offered for a prefix that isn't hidden
+ */
+static int lua_filestep(lua_State *L)
+{
+	index_t *idx = (index_t*) lua_touserdata(L, lua_upvalueindex(1));
+	size_t pos = (size_t) lua_tonumber(L, lua_upvalueindex(2));
+	size_t len;
+	const char *pref = lua_tolstring(L, lua_upvalueindex(3), &len);
+	for (; pos < idx->count; pos++) {
+		const char *name = index_get(idx, pos);
+		if (strncmp(name, pref, len) != 0)
+			break;
+		if (name[0] == '.' && pref[0] != '.' && !lua_toboolean(L, lua_upvalueindex(5)))
+			continue;
+		lua_pushnumber(L, (lua_Number) (pos + 1));
+		lua_replace(L, lua_upvalueindex(2));
+		lua_pushvalue(L, lua_upvalueindex(4));
+		lua_pushstring(L, name);
+		lua_concat(L, 2);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * readline.files(text) - a generator of file names, returns an iterator over the paths starting with the text
+ * The listings of the directories are cached, so completing on a slow filesystem only costs a stat of the directory,
+ * or nothing within the TTL set by readline.filecache. It can be passed to readline.readline as a generator,
+ * or called by a generator function to complete some of the words with paths
+ */
+static int lua_files(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	const char *text = luaL_checkstring(L, 1);
+	const char *slash = strrchr(text, '/');
+	size_t dirlen = slash ? (size_t) (slash - text) + 1 : 0;
+	lua_checkstack(L, 5);
+	lua_pushlstring(L, text, dirlen);
+	int dirpart = lua_gettop(L);
+	char *path = dirlen ? tilde_expand(lua_tostring(L, dirpart)) : clonestr(".");
+	if (!path)
+		return luaL_error(L, "Out of memory");
+	/* Let libreadline quote the matches and mark directories as it does for its own file name completion */
+	rl_filename_completion_desired = 1;
+	int res = dircache_get(L, ctx, path);
+	free(path);
+	if (res < 0)
+		return luaL_error(L, "Out of memory");
+	if (!res) {
+		lua_pushcfunction(L, lua_returnnil);
+		return 1;
+	}
+	index_t *idx = (index_t*) lua_touserdata(L, -1);
+	lua_pushnumber(L, (lua_Number) index_lowerbound(idx, text + dirlen));
+	lua_pushstring(L, text + dirlen);
+	lua_pushvalue(L, dirpart);
+	/* Hidden files are offered for a prefix that isn't hidden only if libreadline is told to */
+	const char *hidden = rl_variable_value("match-hidden-files");
+	lua_pushboolean(L, !hidden || strcmp(hidden, "off") != 0);
+	lua_pushcclosure(L, lua_filestep, 5);
+	return 1;
+}
+
+/**
+ * readline.highlight([fn]) - sets a function colouring the input line as it's edited, nil removes it
+ * The function is called as fn(line, first, last) after every change of the line, first and last being
+ * the positions of the first and the last byte put in place of the old ones (last is first - 1 if bytes have only
+ * been deleted). It returns the position to restyle the line from and an array of escape sequences and byte counts
+ * alternating, such as {"\27[1;34m", 5, "", 1, "\27[32m", 8}: the bytes from the position on get the styles in turn,
+ * "" being the default one. All the other bytes keep their styles, moving with the text around them, and the new ones
+ * start in the default style. So the function only needs to tokenise from a point before the change up to where
+ * its state is the same as before, and only the bytes whose style or position has changed are written to the terminal
+ * again, however long the line is. An error raised by the function ends the input and is raised again by readline.
+ * The terminal is assumed to understand the ANSI cursor movement sequences, and up to 255 distinct sequences
+ * can be used in a line
+ */
+static int lua_highlight(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	if (!lua_isnoneornil(L, 1))
+		luaL_checktype(L, 1, LUA_TFUNCTION);
+	lua_settop(L, 1);
+	ctx_enter(L, ctx);
+	if (lua_isnil(L, 1)) {
+		luaL_unref(L, LUA_REGISTRYINDEX, ctx->highlight.fn);
+		ctx->highlight.fn = LUA_NOREF;
+		if (rl_redisplay_function == highlight_redisplay)
+			rl_redisplay_function = rl_redisplay;
+	} else {
+		setref(L, &ctx->highlight.fn);
+		if (rl_redisplay_function == rl_redisplay)
+			redisplay_install(highlight_redisplay);
+	}
+	ctx_leave(ctx);
+	return 0;
+}
+
+/**
+ * Returns the bindings of a keymap in a context, adding them if add is nonzero, or NULL if there are none
+ * or there's no memory for them
+ */
+static binding_t* binding_get(context_t *ctx, Keymap map, int add)
+{
+	size_t i;
+	for (i = 0; i < ctx->nbindings; i++)
+		if (ctx->bindings[i].map == map)
+			return &ctx->bindings[i];
+	if (!add)
+		return NULL;
+	binding_t *bindings = (binding_t*) realloc(ctx->bindings, (ctx->nbindings + 1) * sizeof(binding_t));
+	if (!bindings)
+		return NULL;
+	ctx->bindings = bindings;
+	binding_t *b = &bindings[ctx->nbindings++];
+	b->map = map;
+	for (i = 0; i < KEYMAP_SIZE; i++)
+		b->refs[i] = LUA_NOREF;
+	return b;
+}
+
+/**
+ * Releases the functions bound by readline.bind in a context
+ */
+static void binding_free(lua_State *L, context_t *ctx)
+{
+	size_t i;
+	int key;
+	for (i = 0; i < ctx->nbindings; i++)
+		for (key = 0; key < KEYMAP_SIZE; key++)
+			luaL_unref(L, LUA_REGISTRYINDEX, ctx->bindings[i].refs[key]);
+	free(ctx->bindings);
+	ctx->bindings = NULL;
+	ctx->nbindings = 0;
+}
+
+/**
+ * Translates a key sequence written the way inputrc does into the keys it stands for, NUL-terminated
+ * Returns NULL if the sequence is invalid or empty, or memory allocation failed
+ */
+static char* binding_keys(const char *seq, int *len)
+{
+	char *keys = (char*) malloc(2 * strlen(seq) + 1);
+	*len = 0;
+	if (!keys)
+		return NULL;
+	if (rl_translate_keyseq(seq, keys, len) || !*len) {
+		free(keys);
+		return NULL;
+	}
+	keys[*len] = '\0';
+	return keys;
+}
+
+/**
+ * Finds the keymap and the key libreadline executes the command bound to a key sequence in a keymap with,
+ * the ones rl_executing_keymap and the key passed to the command are then. That's the map the last key is in,
+ * or the one it's the prefix of, whose ANYOTHERKEY entry holds the command bound to a prefix of longer sequences
+ * Returns NULL if the sequence isn't bound as a whole
+ */
+static Keymap binding_locate(const char *seq, Keymap map, int *key)
+{
+	int len, i;
+	char *keys = binding_keys(seq, &len);
+	if (!keys)
+		return NULL;
+	/* Meta characters are bound as ESC and the character if convert-meta is on, like rl_generic_bind does */
+	const char *convert = rl_variable_value("convert-meta");
+	int meta = convert && !strcmp(convert, "on");
+	for (i = 0; i < len && map; i++) {
+		int c = (unsigned char) keys[i];
+		if (META_CHAR(c) && meta) {
+			c = UNMETA(c);
+			if (map[ESC].type == ISKMAP)
+				map = (Keymap) map[ESC].function;
+		}
+		if (map[c].type == ISKMAP)
+			map = (Keymap) map[c].function;
+		else if (i + 1 < len)
+			map = NULL;
+		*key = c;
+	}
+	free(keys);
+	return map;
+}
+
+/**
+ * The libreadline command of the keys bound by readline.bind: calls the Lua function bound to the key
+ * in the keymap it's executed from. See lua_bind
+ */
+static int binding_dispatch(int count, int key)
+{
+	context_t *ctx = globalCtx;
+	binding_t *b = ctx && key >= 0 && key < KEYMAP_SIZE ? binding_get(ctx, rl_executing_keymap, 0) : NULL;
+	if (!b || b->refs[key] == LUA_NOREF) {
+		/* Bound by another Lua state */
+		rl_ding();
+		return 1;
+	}
+	lua_State *L = ctx->L;
+	lua_checkstack(L, 4);
+	int top = lua_gettop(L);
+	getref(L, b->refs[key]);
+	lua_pushlstring(L, rl_line_buffer, (size_t) rl_end);
+	lua_pushnumber(L, (lua_Number) rl_point);
+	lua_pushnumber(L, (lua_Number) count);
+	if (lua_pcall(L, 3, 3, 0)) {
+		ctx_fail(ctx);
+		return 1;
+	}
+	int point = rl_point;
+	if (lua_type(L, top + 1) == LUA_TSTRING)
+		rl_replace_line(lua_tostring(L, top + 1), 0);
+	if (lua_isnumber(L, top + 2)) {
+		lua_Number n = lua_tonumber(L, top + 2);
+		point = n <= 0 ? 0 : (int) n;
+	}
+	rl_point = point < rl_end ? point : rl_end;
+	int accept = lua_toboolean(L, top + 3);
+	lua_settop(L, top);
+	if (accept)
+		return rl_newline(1, '\n');
+	return 0;
+}
 
 /**
- * An iterator that always returns nil
+ * Returns the keymap of a name, the current one if it's NULL, or NULL if there's no keymap of the name
+ * libreadline is initialised first, so that inputrc read then doesn't override the bindings to be made
  */
-static int lua_returnnil(lua_State *L)
+static Keymap binding_keymap(const char *name)
+{
+	readline_initialize();
+	return name ? rl_get_keymap_by_name(name) : rl_get_keymap();
+}
+
+/**
+ * readline.bind(keyseq, fn[, keymap]) - binds a Lua function to a key sequence in a keymap, the current one by default
+ * The key sequence is written the way inputrc has it, such as "\\C-o", "\\eh" or "\\C-x\\C-h", and the keymap is named
+ * like the keymap variable of inputrc: "emacs", "emacs-ctlx", "vi-insert", "vi-command" and so on.
+ * The function is called as fn(line, point, count) with the line, the number of bytes before the cursor
+ * and the numeric argument. It may return a string to replace the line with, the number of the bytes to have
+ * before the cursor (it stays where it is otherwise), and true to accept the line. An error raised by the function ends the input and is raised
+ * again by readline. The functions are kept in arrays indexed by the key, looked up without the registry
+ * on every keystroke. Only the Lua state that has bound a function has it called
+ */
+static int lua_bind(lua_State *L)
 {
+	context_t *ctx = getcontext(L);
+	const char *seq = luaL_checkstring(L, 1);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	const char *name = luaL_optstring(L, 3, NULL);
+	lua_settop(L, 3);
+	ctx_enter(L, ctx);
+	Keymap map = binding_keymap(name), at;
+	if (!map) {
+		ctx_leave(ctx);
+		return luaL_argerror(L, 3, "unknown keymap");
+	}
+	int type = ISFUNC, key = 0, len;
+	/* rl_function_of_keyseq takes the keys rather than the way they're written */
+	char *keys = binding_keys(seq, &len);
+	rl_command_func_t *old = keys ? rl_function_of_keyseq(keys, map, &type) : NULL;
+	free(keys);
+	binding_t *b = NULL;
+	if (!rl_bind_keyseq_in_map(seq, binding_dispatch, map) && (at = binding_locate(seq, map, &key)))
+		b = binding_get(ctx, at, 1);
+	if (!b) {
+		/* Out of memory or an invalid sequence, put back what it has been bound to */
+		if (type == ISFUNC)
+			rl_bind_keyseq_in_map(seq, old, map);
+		ctx_leave(ctx);
+		return luaL_error(L, "Cannot bind %s", seq);
+	}
+	lua_pushvalue(L, 2);
+	setref(L, &b->refs[key]);
+	ctx_leave(ctx);
 	return 0;
 }
 
 /**
- * A generator that always returns an empty iterator
+ * readline.unbind(keyseq[, keymap]) - unbinds a key sequence in a keymap, the current one by default,
+ * releasing the Lua function bound to it by readline.bind, if any
  */
-static int lua_niliterator(lua_State *L)
+static int lua_unbind(lua_State *L)
 {
-	lua_pushcfunction(L, lua_returnnil);
-	return 1;
+	context_t *ctx = getcontext(L);
+	const char *seq = luaL_checkstring(L, 1);
+	const char *name = luaL_optstring(L, 2, NULL);
+	ctx_enter(L, ctx);
+	Keymap map = binding_keymap(name), at;
+	if (!map) {
+		ctx_leave(ctx);
+		return luaL_argerror(L, 2, "unknown keymap");
+	}
+	int key = 0;
+	binding_t *b = (at = binding_locate(seq, map, &key)) ? binding_get(ctx, at, 0) : NULL;
+	if (b) {
+		luaL_unref(L, LUA_REGISTRYINDEX, b->refs[key]);
+		b->refs[key] = LUA_NOREF;
+	}
+	rl_bind_keyseq_in_map(seq, NULL, map);
+	ctx_leave(ctx);
+	return 0;
 }
 
 /**
- * The iterator function to be returned by lua_ipairsiterator
- * Upvalues:
- * 1-3) The return values from ipairs or the last iterator call
- * 4) The prefix to filter iterated values to start with
+ * readline.filecache([ttl]) - drops the directory listings cached by readline.files and sets the time
+ * in milliseconds a listing is trusted for without checking the modification time of the directory
+ * Without a TTL, or with 0, the modification time is checked on every completion
  */
-static int lua_iterstep(lua_State *L) {
-	lua_checkstack(L, 3);
-	size_t len;
-	/* Get the prefix as string */
-	const char *pref = lua_tolstring(L, lua_upvalueindex(4), &len);
-	for (;;) {
-		/* Simulate the "for" operator behavior */
-		lua_pushvalue(L, lua_upvalueindex(1));
-		lua_pushvalue(L, lua_upvalueindex(2));
-		lua_pushvalue(L, lua_upvalueindex(3));
-		lua_call(L, 2, 2);
-		/* Exchange the "key" and "value" returned values on stack */
-		lua_insert(L, -2);
-		/* Store the "key" returned */
-		lua_replace(L, lua_upvalueindex(3));
-		size_t rlen=0;
-		const char *res=NULL;
-		/* If nil was returned, we have finished the iteration - forward it */
-		if (lua_isnil(L, -1))
-			return 1;
-		/* Get the string returned */
-		res = lua_tolstring(L, -1, &rlen);
-		/* Check if it starts with the prefix supplied when creating the iterator */
-		if (rlen>=len && strncmp(pref, res, len)==0)
-			/* If it matches, return the string */
-			return 1;
-		/* Clear the unmatched value off the stack and fetch a new one */
+static int lua_filecache(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	lua_Number ttl = luaL_optnumber(L, 1, 0);
+	dircache_clear(L, ctx);
+	ctx->dirttl = ttl > 0 ? (uint64_t) ttl : 0;
+	return 0;
+}
+
+/**
+ * Prepares the context for a change of a dictionary: stops the prefetch from it and drops the matches
+ * cached from it, and the fuzzy matcher masks, which would be stale
+ */
+static index_t* dict_modify(lua_State *L, int ud)
+{
+	context_t *ctx = getcontext(L);
+	index_t *idx = (index_t*) luaL_checkudata(L, ud, INDEX_METATABLE);
+	if (ctx->prefetch.idx == idx)
+		prefetch_reset(&ctx->prefetch);
+	lua_checkstack(L, 1);
+	ctx_enter(L, ctx);
+	getref(L, ctx->cachesource);
+	if (lua_rawequal(L, -1, ud))
+		cache_clear(L, ctx);
+	lua_pop(L, 1);
+	ctx_leave(ctx);
+	free(idx->masks);
+	idx->masks = NULL;
+	/* A dictionary opened from a compiled file is copied on the first change */
+	if (!index_unshare(idx))
+		luaL_error(L, "Out of memory");
+	return idx;
+}
+
+/**
+ * Appends the string values of a Lua array to the blob of an index, to be merged with index_merge
+ * Returns zero if memory allocation failed
+ */
+static int dict_appendtable(lua_State *L, index_t *idx, int tbl)
+{
+	size_t n = lua_rawlen(L, tbl), i;
+	lua_checkstack(L, 1);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, tbl, i);
+		if (lua_type(L, -1) == LUA_TSTRING || lua_type(L, -1) == LUA_TNUMBER) {
+			const char *str = lua_tostring(L, -1);
+			if (!index_append(idx, str, strlen(str))) {
+				lua_pop(L, 1);
+				return 0;
+			}
+		}
 		lua_pop(L, 1);
 	}
+	return 1;
 }
 
 /**
- * Generator function that calls ipairs for a given table and wraps the iterator returned by it in a closure
- * Upvalues:
- * 1) The prefix to filter the iterated values to start with
+ * dict:add(str) or dict:add(tbl) - adds a string, or the strings of an array in bulk, to a dictionary
+ * Returns the number of the strings added that the dictionary didn't have
  */
-static int lua_ipairsiterator(lua_State *L) {
-	lua_checkstack(L, 2);
-	lua_getglobal(L, "ipairs");
-	lua_pushvalue(L, lua_upvalueindex(1));
-	lua_call(L, 1, 3);
-	lua_pushvalue(L, 1);
-	lua_pushcclosure(L, lua_iterstep, 4);
+static int lua_dictadd(lua_State *L)
+{
+	index_t *idx = dict_modify(L, 1);
+	size_t before = idx->count, first = idx->used;
+	if (lua_istable(L, 2)) {
+		if (!dict_appendtable(L, idx, 2) || !index_merge(idx, first)) {
+			idx->used = first;
+			return luaL_error(L, "Out of memory");
+		}
+	} else if (index_insert(idx, luaL_checkstring(L, 2)) < 0)
+		return luaL_error(L, "Out of memory");
+	lua_pushnumber(L, (lua_Number) (idx->count - before));
 	return 1;
 }
 
 /**
- * Allocates memory to copy a string and copies it
+ * dict:remove(str) - removes a string from a dictionary
+ * Returns true if the dictionary had it
  */
-static char* clonestr(const char *srcstr)
+static int lua_dictremove(lua_State *L)
 {
-	size_t len = strlen(srcstr)+1;
-	char *dststr = (char*) malloc(len);
-	strlcpy(dststr, srcstr, len);
-	return dststr;
+	index_t *idx = dict_modify(L, 1);
+	lua_pushboolean(L, index_remove(idx, luaL_checkstring(L, 2)));
+	return 1;
 }
 
 /**
- * Generator init function
- * Calls the generator function to get the iterator function and stores the iterator function to the registry
+ * dict:load(path) - adds the lines of a text file to a dictionary in bulk, skipping the empty ones
+ * Returns the number of the strings added that the dictionary didn't have,
+ * or nil, an error message and the error number if the file can't be read
+ */
+static int lua_dictload(lua_State *L)
+{
+	index_t *idx = dict_modify(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+	size_t before = idx->count, first = idx->used, cap = 0;
+	char *line = NULL;
+	ssize_t len;
+	int ok = 1;
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		int err = errno;
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", path, strerror(err));
+		lua_pushnumber(L, (lua_Number) err);
+		return 3;
+	}
+	while (ok && (len = getline(&line, &cap, f)) >= 0) {
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+			len--;
+		line[len] = '\0';
+		if (len > 0)
+			ok = index_append(idx, line, (size_t) len);
+	}
+	free(line);
+	fclose(f);
+	if (!ok || !index_merge(idx, first)) {
+		idx->used = first;
+		return luaL_error(L, "Out of memory");
+	}
+	lua_pushnumber(L, (lua_Number) (idx->count - before));
+	return 1;
+}
+
+/**
+ * dict:clear() - removes all the strings from a dictionary and frees its memory
  */
-static void lua_initgenerator(lua_State *L, const char *text)
+static int lua_dictclear(lua_State *L)
+{
+	index_free(dict_modify(L, 1));
+	return 0;
+}
+
+/**
+ * readline.dict([tbl]) - creates a dictionary: an index that can be changed in place with its methods,
+ * optionally filled with the strings of an array. The strings are kept in a single C arena,
+ * so a large dictionary costs the garbage collector nothing to trace. It can be passed to
+ * readline.readline as a generator and called with a prefix like an index
+ */
+static int lua_newdict(lua_State *L)
 {
 	lua_checkstack(L, 2);
-	lua_pushlightuserdata(L, REGISTRY_KEY_GENERATOR);
-	lua_gettable(L, LUA_REGISTRYINDEX);
-	lua_pushstring(L, text);
-	lua_call(L, 1, 1);
-	lua_pushlightuserdata(L, REGISTRY_KEY_ITERATOR);
-	lua_insert(L, -2);
-	lua_settable(L, LUA_REGISTRYINDEX);
+	index_t *idx = (index_t*) lua_newuserdata(L, sizeof(index_t));
+	index_init(idx);
+	luaL_getmetatable(L, INDEX_METATABLE);
+	lua_setmetatable(L, -2);
+	if (lua_istable(L, 1) && (!dict_appendtable(L, idx, 1) || !index_merge(idx, 0)))
+		return luaL_error(L, "Out of memory");
+	return 1;
 }
 
 /**
- * Generator step function
- * Calls the iterator function and returns its return value as string
+ * readline.compiledict(src, path) - writes the strings of an array or an index to a compiled dictionary file,
+ * sorted and without duplicates, for readline.opendict. The file replaces the old one atomically,
+ * so the processes having it open keep their copy
+ * Returns true, or nil, an error message and the error number
+ */
+static int lua_compiledict(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 2);
+	index_t tmp, *idx = (index_t*) testudata(L, 1, INDEX_METATABLE);
+	if (!idx) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		if (!index_build(L, &tmp, 1)) {
+			index_free(&tmp);
+			return luaL_error(L, "Out of memory");
+		}
+		idx = &tmp;
+	}
+	int err = index_compile(idx, path);
+	if (idx == &tmp)
+		index_free(&tmp);
+	return pushhistoryresult(L, err, path);
+}
+
+/**
+ * readline.opendict(path) - opens a file written by readline.compiledict as a dictionary
+ * The file is memory-mapped rather than read, so opening it takes no time whatever its size, and the processes
+ * opening the same file share one copy of it in the page cache. Only the pages completions look at get read.
+ * The dictionary is used like the one returned by readline.dict, it's copied into memory if it's changed
+ * Returns the dictionary, or nil, an error message and the error number
+ */
+static int lua_opendict(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	lua_checkstack(L, 3);
+	index_t *idx = (index_t*) lua_newuserdata(L, sizeof(index_t));
+	index_init(idx);
+	luaL_getmetatable(L, INDEX_METATABLE);
+	lua_setmetatable(L, -2);
+	int err = index_map(idx, path);
+	if (!err)
+		return 1;
+	lua_pushnil(L);
+	lua_pushfstring(L, "%s: %s", path, err < 0 ? "not a compiled dictionary" : strerror(err));
+	lua_pushnumber(L, (lua_Number) (err < 0 ? EINVAL : err));
+	return 3;
+}
+
+/**
+ * Gets a stream for readline.session from a field of the options table
+ * The field may hold a file descriptor, which is duplicated, or a Lua file, which is referenced
+ * to be kept open. Returns NULL if the field is nil
  */
-static char* lua_stepgenerator(lua_State *L)
+static FILE* session_stream(lua_State *L, int opts, const char *field, const char *mode, int *owned, int *ref)
 {
+	FILE *fd = NULL;
 	lua_checkstack(L, 1);
-	/* Get the generator function that was stored by lua_readline */
-	lua_pushlightuserdata(L, REGISTRY_KEY_ITERATOR);
-	lua_gettable(L, LUA_REGISTRYINDEX);
-	/* Call the generator function */
-	lua_call(L, 0, 1);
+	lua_getfield(L, opts, field);
+	if (lua_type(L, -1) == LUA_TNUMBER) {
+		int dupfd = dup((int) lua_tonumber(L, -1));
+		if (dupfd >= 0 && !(fd = fdopen(dupfd, mode)))
+			close(dupfd);
+		if (!fd)
+			luaL_error(L, "%s: %s", field, strerror(errno));
+		*owned = 1;
+		lua_pop(L, 1);
+		return fd;
+	}
 	if (lua_isnil(L, -1)) {
-		/* If the generator function returned nil, return NULL */
 		lua_pop(L, 1);
 		return NULL;
 	}
-	size_t len;
-	/* Get the string returned by the generator function */
-	const char *str = lua_tolstring(L, -1, &len);
-	/* Allocate memory to copy the string */
-	char *newstr = (char*) malloc(len+1);
-	/* Copy the returned string */
-	strncpy(newstr, str, len+1);
-	/* Return the copied string */
-	return newstr;
-}
-
-/* Wrapper to provide a generator function for libreadline */
-static char* gen_function(const char* text, int state)
-{
-	/* If completion iterator wasn't started, initialize it */
-	if (!state)
-		lua_initgenerator(globalL, text);
-	/* Call the completion iterator */
-	return lua_stepgenerator(globalL);
+#if LUA_VERSION_NUM >= 502
+	luaL_Stream *stream = (luaL_Stream*) testudata(L, -1, LUA_FILEHANDLE);
+	if (stream && stream->closef)
+		fd = stream->f;
+#else
+	FILE **stream = (FILE**) testudata(L, -1, LUA_FILEHANDLE);
+	if (stream)
+		fd = *stream;
+#endif
+	if (!fd)
+		luaL_error(L, "%s: a file descriptor or an open file expected", field);
+	setref(L, ref);
+	return fd;
 }
 
 /**
- * A signal handler returning back into lua_readline function
+ * Checks that the argument at the given stack index is an open session and returns it
  */
-static void readline_sigint(int sig)
+static session_t* checksession(lua_State *L, int idx)
 {
-	siglongjmp(globalEnv, sig);
+	session_t *s = (session_t*) luaL_checkudata(L, idx, SESSION_METATABLE);
+	if (s->closed)
+		luaL_error(L, "attempt to use a closed session");
+	return s;
 }
 
 /**
- * Wrapper function for the readline function
- * Args:
- * 1) Prompt - a string to display before the user input area
- * 2) Generator - a Lua function that returns an iterator of completions or a table of possible completions 
- * The generator function gets called with a single argument - the prefix of a word that has been already entered.
- * Note: this function is not reenterable as it sets libreadline global variables, Lua registry values and system signal handlers
- * Not sure if it will behave correctly in case a signal arrives while the generator function is running, and the signal handler doesn't cause the process to terminate
+ * Releases libreadline resources of a session: removes its callback handler and frees its history list
+ * Returns 0 if the session is in use by a call in progress
  */
-static int lua_readline(lua_State *L)
+static int session_release(lua_State *L, session_t *s)
 {
-	const char *prompt = lua_tolstring(L, 1, NULL);
-	int type = lua_type(L, 2);
-	lua_checkstack(L, 2);
-	lua_pushlightuserdata(L, REGISTRY_KEY_GENERATOR);
-	/* Check what type of generator we have */
-	switch(type) {
-		case LUA_TFUNCTION:
-			/* The generator is a Lua function, use it as is */
-			lua_pushvalue(L, 2);
-			break;
-		case LUA_TTABLE:
-			/* The generator is a Lua table, create an iterator with ipairs */
-			lua_pushvalue(L, 2);
-			lua_pushcclosure(L, lua_ipairsiterator, 1);
-			break;
-		default:
-			/* We have no generator, use an "empty" iterator instead of it */
-			lua_pushcfunction(L, lua_niliterator);
-	}
-	/* Store Lua generator function to the registry */
-	lua_settable(L, LUA_REGISTRYINDEX);
-	/* Point libreadlint to our generator wrapper */
-	rl_completion_entry_function = gen_function;
-	/* Set globalL for it to be available in signal handlers and in the generator function */
-	globalL = L;
-	/* Save old signal handler */
-	sig_t old_sigint = signal(SIGINT, readline_sigint);
-	/* Trap SIGINT handler to cancel libreadline input */
-	int sig = sigsetjmp(globalEnv, 1);
-	if (sig) {
-		/* Clean up libreadline after a signal */
-		rl_free_line_state();
-		rl_cleanup_after_signal();
-		/* Restore the old signal handler */
-		signal(SIGINT, old_sigint);
-		/* Call the old signal handler if there was one */
-		if (old_sigint!=SIG_DFL &&
-		    old_sigint!=SIG_ERR &&
-		    old_sigint!=SIG_IGN)
-			old_sigint(sig);
-		/* If the signal handler didn't cause the process to terminate, return nil */
+	pthread_once(&globalLockOnce, lock_init);
+	pthread_mutex_lock(&globalLock);
+	int busy = globalCtx && globalCtx->depth;
+	if (busy && (globalSession == s || globalHist == &s->hist)) {
+		pthread_mutex_unlock(&globalLock);
 		return 0;
 	}
-	char *line = readline(prompt);
-	/* Restore signals on return */
-	signal(SIGINT, old_sigint);
-	if (!line) {
-		/* If NULL was returned, check for EOF on input */
-		FILE *fd = rl_instream;
-		if (!fd)
-			fd = stdin;
-		if (feof(fd))
-			/* If input is EOF, return nil */
-			return 0;
+	if (s->installed) {
+		if (!busy && session_switch(s))
+			session_removehandler(L, s);
+		else if (s->hasstate) {
+			/* The saved line can't be made current, the undo list is lost */
+			free(s->state.buffer);
+			free(s->state.prompt);
+			s->hasstate = 0;
+			s->installed = 0;
+			globalInstalledSessions--;
+		}
 	}
-	/* Return the string read by readline() */
-	lua_pushstring(L, line);
-	/* Free the string returned by readline() */
-	free(line);
+	if (globalSession == s)
+		session_switch(NULL);
+	hist_free(&s->hist, 0);
+	pthread_mutex_unlock(&globalLock);
+	hmirror_clear(&s->hist.mirror);
+	histlog_close(&s->hist.log);
 	return 1;
 }
 
 /**
- * Wrapper function to get rl_readline_name variable
+ * Closes the streams a session has opened and drops its references, once it's released or if it has failed to open
  */
-static int lua_getname(lua_State *L)
+static void session_free(lua_State *L, session_t *s)
 {
-	lua_pushstring(L, rl_readline_name);
-	return 1;
+	if (s->ownin)
+		fclose(s->in);
+	if (s->ownout)
+		fclose(s->out);
+	s->ownin = s->ownout = 0;
+	luaL_unref(L, LUA_REGISTRYINDEX, s->inref);
+	luaL_unref(L, LUA_REGISTRYINDEX, s->outref);
+	luaL_unref(L, LUA_REGISTRYINDEX, s->handler);
+	luaL_unref(L, LUA_REGISTRYINDEX, s->generator);
+	luaL_unref(L, LUA_REGISTRYINDEX, s->opts);
+	s->inref = s->outref = s->handler = s->generator = s->opts = LUA_NOREF;
+	free(s->name);
+	s->name = NULL;
 }
 
 /**
- * Wrapper function to set rl_readline_name variable
+ * s:close() - removes the callback handler of a session, frees its history and closes the streams it has opened
+ * The Lua files given to readline.session are left open
  */
-static int lua_setname(lua_State *L)
+static int lua_sessionclose(lua_State *L)
 {
-	const char *name = lua_tolstring(L, 1, NULL);
-	if (rl_readline_name)
-		free((void*) rl_readline_name);
-	rl_readline_name = clonestr(name);
-	if (!rl_readline_name)
-		return luaL_error(L, "Out of memory");
+	session_t *s = (session_t*) luaL_checkudata(L, 1, SESSION_METATABLE);
+	if (!s->closed) {
+		if (!session_release(L, s))
+			return luaL_error(L, "The session is in use");
+		s->closed = 1;
+	}
+	session_free(L, s);
 	return 0;
 }
 
 /**
- * Wrapper for readline addhistory() function
+ * __gc metamethod of sessions, closes them like s:close() does without raising errors
+ * A session in use by the call in progress is kept by a reference in the context until ctx_leave closes it
+ * Upvalues:
+ * 1) The context
  */
-static int lua_addhistory(lua_State *L)
+static int lua_sessiongc(lua_State *L)
 {
-	const char *str = lua_tolstring(L, 1, NULL);
-	add_history(str);
+	context_t *ctx = getcontext(L);
+	session_t *s = (session_t*) lua_touserdata(L, 1);
+	if (!s->closed) {
+		if (!session_release(L, s)) {
+			lua_settop(L, 1);
+			setref(L, &ctx->closing);
+			return 0;
+		}
+		s->closed = 1;
+	}
+	session_free(L, s);
 	return 0;
 }
 
+/**
+ * Closes the session lua_sessiongc has left to ctx_leave, which calls it with libreadline still acquired
+ */
+static void ctx_closesession(context_t *ctx)
+{
+	lua_State *L = ctx->L;
+	lua_checkstack(L, 1);
+	getref(L, ctx->closing);
+	session_t *s = (session_t*) lua_touserdata(L, -1);
+	if (s && session_release(L, s)) {
+		s->closed = 1;
+		session_free(L, s);
+	}
+	lua_pop(L, 1);
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->closing);
+	ctx->closing = LUA_NOREF;
+}
+
+/**
+ * Calls a library function for a session
+ * Upvalues:
+ * 1) The context
+ * 2) The library function
+ * The function gets the arguments following the session and works with the streams and the history list
+ * of the session instead of the default ones
+ */
+static int lua_sessioncall(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	session_t *s = checksession(L, 1), *prev = ctx->session;
+	lua_checkstack(L, 1);
+	/* The session stays on the stack below the function, so that it isn't collected while in use */
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_insert(L, 2);
+	ctx->session = s;
+	int depth = ctx->depth;
+	int res = lua_pcall(L, lua_gettop(L) - 2, LUA_MULTRET, 0);
+	ctx->session = prev;
+	if (res) {
+		ctx_unwind(ctx, depth);
+		return lua_error(L);
+	}
+	return lua_gettop(L) - 1;
+}
+
+/**
+ * readline.session{input=..., output=..., name=...} - creates a readline session
+ * Options:
+ *   input - the file descriptor or the Lua file to read the input from, the standard input by default
+ *   output - the file descriptor or the Lua file to write the output to. If the input is a file descriptor,
+ *            it defaults to the same descriptor, so a pty needs to be given once. Otherwise it's the standard output
+ *   name - the value of rl_readline_name for the session, the current one by default
+ * A session has a history list, a callback handler and completion of its own. Its methods are the library functions
+ * readline, handlerinstall, readchar, handlerremove, fileno, getname, setname and the history functions,
+ * called as s:readline(prompt, gen, opts) and so on, plus s:close().
+ * Every session can have a callback handler installed at the same time, the line state of libreadline
+ * is saved and restored when input arrives for another session. The terminals are assumed to be of the same type,
+ * and a command reading several keys (such as an incremental search) should be finished before switching
+ */
+static int lua_newsession(lua_State *L)
+{
+	context_t *ctx = getcontext(L);
+	if (!lua_isnoneornil(L, 1))
+		luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+	lua_checkstack(L, 3);
+	session_t *s = (session_t*) lua_newuserdata(L, sizeof(session_t));
+	memset(s, 0, sizeof(session_t));
+	s->inref = s->outref = s->handler = s->generator = s->opts = LUA_NOREF;
+	/* Closed until opened, so that a failure below leaves __gc only the streams to release */
+	s->closed = 1;
+	luaL_getmetatable(L, SESSION_METATABLE);
+	lua_setmetatable(L, -2);
+	if (lua_istable(L, 1)) {
+		s->in = session_stream(L, 1, "input", "r", &s->ownin, &s->inref);
+		s->out = session_stream(L, 1, "output", "w", &s->ownout, &s->outref);
+		if (!s->out && s->ownin) {
+			/* A terminal is usually both read and written */
+			int dupfd = dup(fileno(s->in));
+			if (dupfd >= 0 && !(s->out = fdopen(dupfd, "w")))
+				close(dupfd);
+			if (!s->out)
+				return luaL_error(L, "output: %s", strerror(errno));
+			s->ownout = 1;
+		}
+		lua_getfield(L, 1, "name");
+	} else
+		lua_pushnil(L);
+	if (!s->in)
+		s->in = stdin;
+	if (!s->out)
+		s->out = stdout;
+	const char *name = lua_tostring(L, -1);
+	if (!name) {
+		ctx_enter(L, ctx);
+		name = globalSession ? globalDefaultName : rl_readline_name;
+		ctx_leave(ctx);
+	}
+	s->name = (char*) malloc(strlen(name ? name : "") + 1);
+	if (!s->name)
+		return luaL_error(L, "Out of memory");
+	strcpy(s->name, name ? name : "");
+	lua_pop(L, 1);
+	s->closed = 0;
+	return 1;
+}
+
 typedef struct _reg_t {
 	const char *name;
 	int (*func)(lua_State*);
@@ -280,31 +6385,224 @@ typedef struct _reg_t {
 reg_t R[] = {
 	{"readline", lua_readline},
 	{"addhistory", lua_addhistory},
+	{"loadhistory", lua_loadhistory},
+	{"savehistory", lua_savehistory},
+	{"appendhistory", lua_appendhistory},
+	{"truncatehistory", lua_truncatehistory},
+	{"historydups", lua_historydups},
+	{"stifle", lua_stifle},
+	{"unstifle", lua_unstifle},
+	{"historylimit", lua_historylimit},
+	{"historystats", lua_historystats},
+	{"searchhistory", lua_searchhistory},
+	{"historylog", lua_historylog},
+	{"getname", lua_getname},
+	{"setname", lua_setname},
+	{"index", lua_newindex},
+	{"dict", lua_newdict},
+	{"compiledict", lua_compiledict},
+	{"opendict", lua_opendict},
+	{"clearcache", lua_clearcache},
+	{"truncated", lua_truncated},
+	{"stats", lua_stats},
+	{"files", lua_files},
+	{"filecache", lua_filecache},
+	{"highlight", lua_highlight},
+	{"bind", lua_bind},
+	{"unbind", lua_unbind},
+	{"handlerinstall", lua_handlerinstall},
+	{"readchar", lua_readchar},
+	{"handlerremove", lua_handlerremove},
+	{"fileno", lua_fileno},
+	{"lines", lua_lines},
+	{"readchunk", lua_readchunk},
+#if LUA_VERSION_NUM >= 502
+	{"co_readline", lua_coreadline},
+#endif
+	{"session", lua_newsession},
+	{NULL, NULL},
+};
+
+/**
+ * The library functions available as methods of sessions, called through lua_sessioncall
+ */
+reg_t SESSION_METHODS[] = {
+	{"readline", lua_readline},
+	{"handlerinstall", lua_handlerinstall},
+	{"readchar", lua_readchar},
+	{"handlerremove", lua_handlerremove},
+	{"fileno", lua_fileno},
 	{"getname", lua_getname},
 	{"setname", lua_setname},
+	{"addhistory", lua_addhistory},
+	{"loadhistory", lua_loadhistory},
+	{"savehistory", lua_savehistory},
+	{"appendhistory", lua_appendhistory},
+	{"stifle", lua_stifle},
+	{"unstifle", lua_unstifle},
+	{"historystats", lua_historystats},
+	{"searchhistory", lua_searchhistory},
+	{"historylog", lua_historylog},
+	{NULL, NULL},
+};
+
+/**
+ * The methods of the index userdata, changing it in place as a dictionary
+ */
+reg_t DICT_METHODS[] = {
+	{"add", lua_dictadd},
+	{"remove", lua_dictremove},
+	{"load", lua_dictload},
+	{"clear", lua_dictclear},
+	{NULL, NULL},
+};
+
+/**
+ * The metamethods of the index userdata
+ */
+reg_t INDEX_META[] = {
+	{"__call", lua_indexcall},
+	{"__len", lua_indexlen},
+	{"__gc", lua_indexgc},
 	{NULL, NULL},
 };
 
 /**
  * Lua 5.1 compatibility function
- * Puts a set of C functions into a table
+ * Puts a set of C functions into a table, like luaL_setfuncs does:
+ * the table is below nup values on the stack, which become the upvalues of every function and are popped
  */
-static void lua_reg(lua_State *L, reg_t *reg)
+static void lua_reg(lua_State *L, reg_t *reg, int nup)
 {
 	reg_t *r;
+	int i;
+	lua_checkstack(L, nup + 1);
 	for (r=reg; r->name && r->func; r++) {
-		lua_pushcfunction(L, r->func);
-		lua_setfield(L, -2, r->name);
+		for (i = 0; i < nup; i++)
+			lua_pushvalue(L, -nup);
+		lua_pushcclosure(L, r->func, nup);
+		lua_setfield(L, -(nup + 2), r->name);
+	}
+	lua_pop(L, nup);
+}
+
+/**
+ * Registers functions in the table below the context on top of the stack like lua_reg does with the context
+ * as the upvalue, wrapped in lua_guarded. readline.co_readline yields, so it guards its own start instead
+ */
+static void lua_regguarded(lua_State *L, reg_t *reg)
+{
+	reg_t *r;
+	for (r = reg; r->name && r->func; r++) {
+#if LUA_VERSION_NUM >= 502
+		if (r->func == lua_coreadline) {
+			lua_checkstack(L, 1);
+			lua_pushvalue(L, -1);
+			lua_pushcclosure(L, r->func, 1);
+		} else
+#endif
+		pushguarded(L, -1, r->func);
+		lua_setfield(L, -3, r->name);
+	}
+	lua_pop(L, 1);
+}
+
+/**
+ * Releases everything a context owns when the Lua state having loaded the library is closed
+ * The history list of the context is freed, unless it's the one libreadline is using
+ */
+static int lua_contextgc(lua_State *L)
+{
+	context_t *ctx = (context_t*) lua_touserdata(L, 1);
+	pthread_once(&globalLockOnce, lock_init);
+	pthread_mutex_lock(&globalLock);
+	if (ctx->installed) {
+		rl_callback_handler_remove();
+		globalCallbackCtx = NULL;
 	}
+	if (globalCtx == ctx)
+		globalCtx = NULL;
+	/* The history may be used by the host program, leave it to libreadline */
+	hist_free(&ctx->ownhist, 1);
+	pthread_mutex_unlock(&globalLock);
+	hmirror_clear(&ctx->ownhist.mirror);
+	histlog_close(&ctx->ownhist.log);
+	cache_clear(L, ctx);
+	dircache_clear(L, ctx);
+	highlight_free(&ctx->highlight);
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->highlight.fn);
+	binding_free(L, ctx);
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->display);
+	page_clear(L, ctx);
+	prefetch_free(&ctx->prefetch);
+	/* For lua_indexgc not to touch the prefetch state any more */
+	ctx->prefetch.idx = NULL;
+	matches_free(&ctx->pending);
+	free(ctx->linebuf);
+	free(ctx->chunkbuf);
+	free(ctx->coline);
+	return 0;
 }
 
 /**
  * Creates a table representing readline library functions and returns it
+ * Every Lua state loading the library gets its own context, shared by the functions as their upvalue
  */
 int luaopen_readline(lua_State *L) {
-	lua_checkstack(L, 2);
+	lua_checkstack(L, 7);
+	context_t *ctx = (context_t*) lua_newuserdata(L, sizeof(context_t));
+	memset(ctx, 0, sizeof(context_t));
+	ctx->generator = ctx->iterator = ctx->source = ctx->cachesource = LUA_NOREF;
+	ctx->handler = ctx->error = ctx->prefetchindex = ctx->highlight.fn = LUA_NOREF;
+	ctx->display = ctx->pageindex = ctx->closing = LUA_NOREF;
+	int i;
+	for (i = 0; i < DIRCACHE_SIZE; i++)
+		ctx->dircache[i].listing = LUA_NOREF;
+	pthread_mutex_init(&ctx->prefetch.lock, NULL);
+	pthread_cond_init(&ctx->prefetch.cond, NULL);
+	ctx->dupsmode = DUPS_KEEP;
+	luaL_newmetatable(L, CONTEXT_METATABLE);
+	lua_pushcfunction(L, lua_contextgc);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	/* The metamethods and the dictionary methods of indexes get the context to keep the prefetch
+	 * and the cache consistent */
+	luaL_newmetatable(L, INDEX_METATABLE);
+	lua_pushvalue(L, -2);
+	lua_reg(L, INDEX_META, 1);
 	lua_createtable(L, 0, 4);
-	lua_reg(L, R);
+	lua_pushvalue(L, -3);
+	lua_regguarded(L, DICT_METHODS);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+	/* Sessions get the library functions called through lua_sessioncall as their methods */
+	luaL_newmetatable(L, SESSION_METATABLE);
+	lua_pushvalue(L, -2);
+	lua_pushcclosure(L, lua_sessiongc, 1);
+	lua_setfield(L, -2, "__gc");
+	lua_createtable(L, 0, 17);
+	reg_t *r;
+	for (r = SESSION_METHODS; r->name; r++) {
+		lua_pushvalue(L, -3);
+		lua_pushvalue(L, -1);
+		lua_pushcclosure(L, r->func, 1);
+		lua_pushcclosure(L, lua_sessioncall, 2);
+		lua_setfield(L, -2, r->name);
+	}
+	lua_pushcfunction(L, lua_sessionclose);
+	lua_setfield(L, -2, "close");
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+	lua_createtable(L, 0, 35);
+	lua_insert(L, -2);
+#if LUA_VERSION_NUM < 502
+	luaL_loadbuffer(L, CO_READLINE, sizeof(CO_READLINE) - 1, "=co_readline");
+	pushguarded(L, -2, lua_costart);
+	pushguarded(L, -3, lua_costep);
+	lua_call(L, 2, 1);
+	lua_setfield(L, -3, "co_readline");
+#endif
+	lua_regguarded(L, R);
 	return 1;
 }
 